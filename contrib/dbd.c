@@ -0,0 +1,618 @@
+/*
+ * Copyright (c) 2020-2021 illiliti <illiliti@protonmail.com>
+ * SPDX-License-Identifier: ISC
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * Keep a snapshot of all devices and their properties in a file, so that
+ * libudev-zero can read devices from one shared mapping instead of building
+ * them from sysfs in every process. The snapshot follows the 0x4 netlink
+ * group and is replaced atomically after each burst of uevents. The daemon
+ * holds a write lock on "<path>.lock" while it runs and readers ignore the
+ * snapshot once the lock is gone.
+ *
+ * usage: dbd [-p /run/libudev-zero/db]
+ *
+ * All integers are native-endian u32, all records are 4-byte aligned and
+ * string offsets are from the start of the file, 0 meaning NULL.
+ *
+ * header:  "LUZUDEV1", version(2), boot_id padded to 40 bytes with NULs,
+ *          file size, record count, bucket count(power of two), offset of
+ *          first record, offset of string table
+ * buckets: offset of first record in chain, 0 if empty
+ * records: offset of next record in chain, hash of syspath(32-bit FNV-1a),
+ *          syspath, property count, pairs of key and value
+ * strings: NUL-terminated strings, the file always ends with NUL
+ */
+
+#include <poll.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <libudev.h>
+
+#define HEADER_SIZE 72
+
+struct device {
+    char *syspath;
+    char **props;
+    size_t cnt;
+};
+
+static struct device *devices;
+static size_t devices_cnt, devices_len;
+
+// open addressing index of devices by syspath, slots hold position + 1
+static size_t *slots;
+static size_t slots_len;
+
+static unsigned char *strings;
+static size_t strings_cnt, strings_len;
+static uint32_t *table;
+static size_t table_cnt, table_len;
+static uint32_t strings_off;
+
+static uint32_t hash_string(const char *str)
+{
+    uint32_t hash = 2166136261U;
+
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static void free_device(struct device *device)
+{
+    size_t i;
+
+    for (i = 0; i < device->cnt * 2; i++) {
+        free(device->props[i]);
+    }
+
+    free(device->props);
+    free(device->syspath);
+}
+
+static size_t *find_slot(const char *syspath)
+{
+    size_t i, mask = slots_len - 1;
+
+    for (i = hash_string(syspath) & mask; slots[i]; i = (i + 1) & mask) {
+        if (strcmp(devices[slots[i] - 1].syspath, syspath) == 0) {
+            break;
+        }
+    }
+
+    return &slots[i];
+}
+
+// positions shift on removal, so the index is rebuilt rather than updated
+static int index_devices(void)
+{
+    size_t i, len = slots_len ? slots_len : 1024;
+    size_t *tmp;
+
+    while (len < devices_cnt * 2 + 2) {
+        len *= 2;
+    }
+
+    if (len != slots_len) {
+        tmp = calloc(len, sizeof(*tmp));
+
+        if (!tmp) {
+            return -1;
+        }
+
+        free(slots);
+        slots = tmp;
+        slots_len = len;
+    }
+    else {
+        memset(slots, 0, slots_len * sizeof(*slots));
+    }
+
+    for (i = 0; i < devices_cnt; i++) {
+        *find_slot(devices[i].syspath) = i + 1;
+    }
+
+    return 0;
+}
+
+static struct device *find_device(const char *syspath)
+{
+    size_t *slot;
+
+    if (!slots_len) {
+        return NULL;
+    }
+
+    slot = find_slot(syspath);
+    return *slot ? &devices[*slot - 1] : NULL;
+}
+
+static void remove_device(const char *syspath)
+{
+    struct device *device;
+
+    device = find_device(syspath);
+
+    if (!device) {
+        return;
+    }
+
+    free_device(device);
+    memmove(device, device + 1, (devices + devices_cnt - device - 1) * sizeof(*device));
+    devices_cnt--;
+
+    // the table doesn't grow here, so this can't fail
+    index_devices();
+}
+
+static int add_prop(struct device *device, const char *key, const char *value)
+{
+    char **tmp;
+
+    tmp = realloc(device->props, (device->cnt + 1) * 2 * sizeof(*tmp));
+
+    if (!tmp) {
+        return -1;
+    }
+
+    device->props = tmp;
+    device->props[device->cnt * 2] = strdup(key);
+    device->props[device->cnt * 2 + 1] = value ? strdup(value) : NULL;
+    device->cnt++;
+
+    if (!device->props[device->cnt * 2 - 2] || (value && !device->props[device->cnt * 2 - 1])) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int get_props(struct device *device, struct udev_device *udev_device)
+{
+    struct udev_list_entry *list_entry;
+    char links[8192];
+    size_t len = 0;
+
+    udev_list_entry_foreach(list_entry, udev_device_get_properties_list_entry(udev_device)) {
+        if (add_prop(device, udev_list_entry_get_name(list_entry),
+                    udev_list_entry_get_value(list_entry)) == -1) {
+            return -1;
+        }
+    }
+
+    if (udev_device_get_property_value(udev_device, "DEVLINKS")) {
+        return 0;
+    }
+
+    // store links as well, so that readers don't have to index /dev
+    udev_list_entry_foreach(list_entry, udev_device_get_devlinks_list_entry(udev_device)) {
+        len += snprintf(links + len, sizeof(links) - len, "%s%s", len ? " " : "",
+                udev_list_entry_get_name(list_entry));
+
+        if (len >= sizeof(links)) {
+            return 0;
+        }
+    }
+
+    return len ? add_prop(device, "DEVLINKS", links) : 0;
+}
+
+// keep the same set of devices that udev_enumerate_scan_devices() finds
+static int set_device(struct udev *udev, const char *syspath)
+{
+    struct udev_device *udev_device;
+    struct device device = {0}, *tmp;
+
+    udev_device = udev_device_new_from_syspath(udev, syspath);
+
+    if (!udev_device) {
+        remove_device(syspath);
+        return 0;
+    }
+
+    if (strncmp(udev_device_get_syspath(udev_device), "/sys/devices/", 13) != 0) {
+        udev_device_unref(udev_device);
+        remove_device(syspath);
+        return 0;
+    }
+
+    device.syspath = strdup(udev_device_get_syspath(udev_device));
+
+    if (!device.syspath || get_props(&device, udev_device) == -1) {
+        udev_device_unref(udev_device);
+        free_device(&device);
+        return -1;
+    }
+
+    udev_device_unref(udev_device);
+    tmp = find_device(device.syspath);
+
+    if (tmp) {
+        free_device(tmp);
+        *tmp = device;
+        return 0;
+    }
+
+    if (devices_cnt == devices_len) {
+        tmp = realloc(devices, (devices_len * 2 + 256) * sizeof(*devices));
+
+        if (!tmp) {
+            free_device(&device);
+            return -1;
+        }
+
+        devices = tmp;
+        devices_len = devices_len * 2 + 256;
+    }
+
+    devices[devices_cnt++] = device;
+
+    if (devices_cnt * 2 + 2 > slots_len) {
+        return index_devices();
+    }
+
+    *find_slot(device.syspath) = devices_cnt;
+    return 0;
+}
+
+static int scan_devices(struct udev *udev)
+{
+    struct udev_enumerate *udev_enumerate;
+    struct udev_list_entry *list_entry;
+    int ret = 0;
+
+    while (devices_cnt > 0) {
+        free_device(&devices[--devices_cnt]);
+    }
+
+    if (index_devices() == -1) {
+        return -1;
+    }
+
+    udev_enumerate = udev_enumerate_new(udev);
+
+    if (!udev_enumerate || udev_enumerate_scan_devices(udev_enumerate) == -1) {
+        udev_enumerate_unref(udev_enumerate);
+        return -1;
+    }
+
+    udev_list_entry_foreach(list_entry, udev_enumerate_get_list_entry(udev_enumerate)) {
+        if (set_device(udev, udev_list_entry_get_name(list_entry)) == -1) {
+            ret = -1;
+            break;
+        }
+    }
+
+    udev_enumerate_unref(udev_enumerate);
+    return ret;
+}
+
+// strings are deduplicated, keys such as SUBSYSTEM repeat in every record
+static int add_string(const char *str, uint32_t *off)
+{
+    size_t len = strlen(str) + 1, i, j, mask;
+    unsigned char *tmp;
+    uint32_t *tmp2;
+
+    if (table_cnt * 2 >= table_len) {
+        tmp2 = calloc(table_len * 2 + 4096, sizeof(*tmp2));
+
+        if (!tmp2) {
+            return -1;
+        }
+
+        mask = table_len * 2 + 4095;
+
+        for (i = 0; i < table_len; i++) {
+            if (!table[i]) {
+                continue;
+            }
+
+            j = hash_string((char *)strings + table[i] - strings_off) & mask;
+
+            while (tmp2[j]) {
+                j = (j + 1) & mask;
+            }
+
+            tmp2[j] = table[i];
+        }
+
+        free(table);
+        table = tmp2;
+        table_len = mask + 1;
+    }
+
+    mask = table_len - 1;
+
+    for (i = hash_string(str) & mask; table[i]; i = (i + 1) & mask) {
+        if (strcmp((char *)strings + table[i] - strings_off, str) == 0) {
+            *off = table[i];
+            return 0;
+        }
+    }
+
+    if (strings_cnt + len > strings_len) {
+        tmp = realloc(strings, strings_len * 2 + len + 65536);
+
+        if (!tmp) {
+            return -1;
+        }
+
+        strings = tmp;
+        strings_len = strings_len * 2 + len + 65536;
+    }
+
+    memcpy(strings + strings_cnt, str, len);
+    *off = table[i] = strings_off + strings_cnt;
+    strings_cnt += len;
+    table_cnt++;
+    return 0;
+}
+
+static int read_boot_id(char *buf, size_t len)
+{
+    size_t cnt;
+    FILE *file;
+
+    file = fopen("/proc/sys/kernel/random/boot_id", "r");
+
+    if (!file) {
+        return -1;
+    }
+
+    cnt = fread(buf, 1, len - 1, file);
+    fclose(file);
+
+    while (cnt > 0 && buf[cnt - 1] == '\n') {
+        cnt--;
+    }
+
+    buf[cnt] = '\0';
+    return cnt > 0 ? 0 : -1;
+}
+
+static int write_file(const char *path)
+{
+    uint32_t *buf, *rec, buckets = 16, records, off, hash;
+    size_t i, j, len;
+    char tmp[4096];
+    FILE *file;
+    int ret = -1;
+
+    while (buckets < devices_cnt * 2) {
+        buckets *= 2;
+    }
+
+    records = HEADER_SIZE + buckets * 4;
+    len = records;
+
+    for (i = 0; i < devices_cnt; i++) {
+        len += 16 + devices[i].cnt * 8;
+    }
+
+    buf = calloc(1, len);
+
+    if (!buf) {
+        return -1;
+    }
+
+    // start with an empty string, so that the file always ends with NUL
+    strings_off = len;
+    strings_cnt = 0;
+    table_cnt = 0;
+
+    if (table) {
+        memset(table, 0, table_len * sizeof(*table));
+    }
+
+    if (add_string("", &off) == -1) {
+        goto out;
+    }
+
+    off = records;
+
+    for (i = 0; i < devices_cnt; i++) {
+        rec = buf + off / 4;
+        hash = hash_string(devices[i].syspath);
+        rec[0] = buf[HEADER_SIZE / 4 + (hash & (buckets - 1))];
+        rec[1] = hash;
+        rec[3] = devices[i].cnt;
+        buf[HEADER_SIZE / 4 + (hash & (buckets - 1))] = off;
+
+        if (add_string(devices[i].syspath, &rec[2]) == -1) {
+            goto out;
+        }
+
+        for (j = 0; j < devices[i].cnt * 2; j++) {
+            if (devices[i].props[j] && add_string(devices[i].props[j], &rec[4 + j]) == -1) {
+                goto out;
+            }
+        }
+
+        off += 16 + devices[i].cnt * 8;
+    }
+
+    memcpy(buf, "LUZUDEV1", 8);
+    buf[2] = 2;
+
+    if (read_boot_id((char *)(buf + 3), 40) == -1) {
+        fprintf(stderr, "failed to read boot_id\n");
+        goto out;
+    }
+
+    buf[13] = len + strings_cnt;
+    buf[14] = devices_cnt;
+    buf[15] = buckets;
+    buf[16] = records;
+    buf[17] = strings_off;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    file = fopen(tmp, "w");
+
+    if (!file) {
+        perror(tmp);
+        goto out;
+    }
+
+    fwrite(buf, 1, len, file);
+    fwrite(strings, 1, strings_cnt, file);
+
+    if (fflush(file) == EOF || ferror(file) || fsync(fileno(file)) == -1) {
+        perror(tmp);
+        fclose(file);
+        unlink(tmp);
+        goto out;
+    }
+
+    fclose(file);
+
+    // readers may have the old snapshot mapped, replace it atomically
+    if (rename(tmp, path) == -1) {
+        perror(path);
+        unlink(tmp);
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    free(buf);
+    return ret;
+}
+
+static int handle_events(struct udev *udev, struct udev_monitor *udev_monitor)
+{
+    struct udev_device *udev_device;
+    const char *action;
+    int ret = 0;
+
+    while ((udev_device = udev_monitor_receive_device(udev_monitor))) {
+        action = udev_device_get_action(udev_device);
+
+        if (action && strcmp(action, "remove") == 0) {
+            remove_device(udev_device_get_syspath(udev_device));
+        }
+        else if (set_device(udev, udev_device_get_syspath(udev_device)) == -1) {
+            ret = -1;
+        }
+
+        udev_device_unref(udev_device);
+    }
+
+    // uevents were dropped, the only way to catch up is a full scan
+    if (errno == ENOBUFS) {
+        return scan_devices(udev);
+    }
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = "/run/libudev-zero/db";
+    struct udev_monitor *udev_monitor;
+    struct pollfd pfd;
+    struct flock fl;
+    struct udev *udev;
+    char dir[4096];
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "p:")) != -1) {
+        switch (opt) {
+        case 'p':
+            path = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p path]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    snprintf(dir, sizeof(dir), "%s", path);
+
+    if (strrchr(dir, '/')) {
+        *strrchr(dir, '/') = '\0';
+        mkdir(dir, 0755);
+    }
+
+    // readers trust the snapshot only while this lock is held. the lock is
+    // released by the kernel whenever the daemon exits. libudev-zero keeps
+    // its own descriptor of the lock file open, so the udev context must
+    // live as long as the daemon
+    snprintf(dir, sizeof(dir), "%s.lock", path);
+    fd = open(dir, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+
+    if (fd == -1 || fcntl(fd, F_SETLK, &fl) == -1) {
+        perror(dir);
+        return 1;
+    }
+
+    udev = udev_new();
+    udev_monitor = udev_monitor_new_from_netlink(udev, "udev");
+
+    if (!udev_monitor) {
+        perror("udev_monitor_new_from_netlink");
+        return 1;
+    }
+
+    // listen before scanning, so that no uevent falls in between
+    udev_monitor_set_receive_buffer_size(udev_monitor, 8 * 1024 * 1024);
+    udev_monitor_enable_receiving(udev_monitor);
+
+    if (scan_devices(udev) == -1 || write_file(path) == -1) {
+        return 1;
+    }
+
+    pfd.fd = udev_monitor_get_fd(udev_monitor);
+    pfd.events = POLLIN;
+
+    while (1) {
+        if (poll(&pfd, 1, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("poll");
+            return 1;
+        }
+
+        // coalesce bursts such as coldplug into a single write
+        do {
+            errno = 0;
+
+            if (handle_events(udev, udev_monitor) == -1) {
+                return 1;
+            }
+        } while (poll(&pfd, 1, 100) > 0);
+
+        if (write_file(path) == -1) {
+            return 1;
+        }
+    }
+}
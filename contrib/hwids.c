@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) 2020-2021 illiliti <illiliti@protonmail.com>
+ * SPDX-License-Identifier: ISC
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * Build vendor/model lookup table from pci.ids and usb.ids. libudev-zero
+ * reads it through udev_hwdb_* when no hwdb.bin is installed.
+ *
+ * usage: hwids [-p pci.ids] [-u usb.ids] /usr/share/libudev-zero/hwids.bin
+ *
+ * All integers are little-endian.
+ *
+ * header:  "LUZHWID1", u32 entry count, u32 offset of string table
+ * entries: u16 bus(0 - pci, 1 - usb), u16 vendor, u16 device, u16 subvendor,
+ *          u16 subdevice, u8 level(0 - vendor, 1 - device, 2 - subsystem),
+ *          u8 padding, u32 offset of name in string table
+ * strings: NUL-terminated names
+ *
+ * Entries are sorted by bus, vendor, device, subvendor, subdevice and level,
+ * unused fields are zero.
+ */
+
+#include <stdio.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct entry {
+    unsigned int key[6];
+    uint32_t name;
+};
+
+static struct entry *entries;
+static size_t entries_cnt, entries_len;
+static char *strings;
+static size_t strings_cnt, strings_len;
+
+static int add_string(const char *str, uint32_t *off)
+{
+    size_t len = strlen(str) + 1;
+    char *tmp;
+
+    if (strings_cnt + len > strings_len) {
+        tmp = realloc(strings, strings_len * 2 + len + 65536);
+
+        if (!tmp) {
+            return -1;
+        }
+
+        strings = tmp;
+        strings_len = strings_len * 2 + len + 65536;
+    }
+
+    memcpy(strings + strings_cnt, str, len);
+    *off = strings_cnt;
+    strings_cnt += len;
+    return 0;
+}
+
+static int add_entry(const unsigned int *key, const char *name)
+{
+    struct entry *tmp;
+
+    if (entries_cnt == entries_len) {
+        tmp = realloc(entries, (entries_len * 2 + 1024) * sizeof(*entries));
+
+        if (!tmp) {
+            return -1;
+        }
+
+        entries = tmp;
+        entries_len = entries_len * 2 + 1024;
+    }
+
+    memcpy(entries[entries_cnt].key, key, sizeof(entries[entries_cnt].key));
+
+    if (add_string(name, &entries[entries_cnt].name) == -1) {
+        return -1;
+    }
+
+    entries_cnt++;
+    return 0;
+}
+
+// "xxxx" followed by at least one space
+static int parse_id(const char *str, unsigned int *val)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        if (!isxdigit((unsigned char)str[i])) {
+            return 0;
+        }
+    }
+
+    if (str[4] != ' ') {
+        return 0;
+    }
+
+    *val = strtoul(str, NULL, 16);
+    return 1;
+}
+
+static const char *skip_space(const char *str)
+{
+    while (*str == ' ') {
+        str++;
+    }
+
+    return str;
+}
+
+static int parse_file(const char *path, unsigned int bus)
+{
+    unsigned int key[6] = {0};
+    char line[1024];
+    int vendor = 0;
+    size_t len;
+    FILE *file;
+
+    file = fopen(path, "r");
+
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+
+    key[0] = bus;
+
+    while (fgets(line, sizeof(line), file)) {
+        len = strlen(line);
+
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+
+        if (line[0] != '\t') {
+            // anything else than a vendor starts a section(classes, etc.)
+            vendor = parse_id(line, &key[1]);
+
+            if (vendor) {
+                key[2] = key[3] = key[4] = 0;
+                key[5] = 0;
+
+                if (add_entry(key, skip_space(line + 4)) == -1) {
+                    break;
+                }
+            }
+        }
+        else if (!vendor) {
+            continue;
+        }
+        else if (line[1] != '\t') {
+            if (parse_id(line + 1, &key[2])) {
+                key[3] = key[4] = 0;
+                key[5] = 1;
+
+                if (add_entry(key, skip_space(line + 5)) == -1) {
+                    break;
+                }
+            }
+        }
+        else if (bus == 0) {
+            if (parse_id(line + 2, &key[3]) && parse_id(line + 7, &key[4])) {
+                key[5] = 2;
+
+                if (add_entry(key, skip_space(line + 11)) == -1) {
+                    break;
+                }
+            }
+        }
+    }
+
+    if (ferror(file) || !feof(file)) {
+        fprintf(stderr, "%s: failed to parse\n", path);
+        fclose(file);
+        return -1;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+static int cmp_entry(const void *a, const void *b)
+{
+    const struct entry *e1 = a, *e2 = b;
+    int i;
+
+    for (i = 0; i < 6; i++) {
+        if (e1->key[i] != e2->key[i]) {
+            return e1->key[i] < e2->key[i] ? -1 : 1;
+        }
+    }
+
+    return 0;
+}
+
+static void put16(unsigned char *p, unsigned int val)
+{
+    p[0] = val & 0xff;
+    p[1] = (val >> 8) & 0xff;
+}
+
+static void put32(unsigned char *p, uint32_t val)
+{
+    put16(p, val & 0xffff);
+    put16(p + 2, val >> 16);
+}
+
+static int write_file(const char *path)
+{
+    unsigned char buf[16];
+    char tmp[4096];
+    size_t i, j;
+    FILE *file;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    file = fopen(tmp, "w");
+
+    if (!file) {
+        perror(tmp);
+        return -1;
+    }
+
+    memcpy(buf, "LUZHWID1", 8);
+    put32(buf + 8, entries_cnt);
+    put32(buf + 12, 16 + entries_cnt * 16);
+    fwrite(buf, 1, sizeof(buf), file);
+
+    for (i = 0; i < entries_cnt; i++) {
+        for (j = 0; j < 5; j++) {
+            put16(buf + j * 2, entries[i].key[j]);
+        }
+
+        buf[10] = entries[i].key[5];
+        buf[11] = 0;
+        put32(buf + 12, entries[i].name);
+        fwrite(buf, 1, sizeof(buf), file);
+    }
+
+    fwrite(strings, 1, strings_cnt, file);
+
+    if (fflush(file) == EOF || ferror(file) || fsync(fileno(file)) == -1) {
+        perror(tmp);
+        fclose(file);
+        unlink(tmp);
+        return -1;
+    }
+
+    fclose(file);
+
+    // readers may have the old table mapped, replace it atomically
+    if (rename(tmp, path) == -1) {
+        perror(path);
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:u:")) != -1) {
+        switch (opt) {
+        case 'p':
+            if (parse_file(optarg, 0) == -1) {
+                return 1;
+            }
+            break;
+        case 'u':
+            if (parse_file(optarg, 1) == -1) {
+                return 1;
+            }
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (optind + 1 != argc) {
+        goto usage;
+    }
+
+    qsort(entries, entries_cnt, sizeof(*entries), cmp_entry);
+    return write_file(argv[optind]) == -1;
+
+usage:
+    fprintf(stderr, "usage: %s [-p pci.ids] [-u usb.ids] output\n", argv[0]);
+    return 1;
+}
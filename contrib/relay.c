@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2020-2021 illiliti <illiliti@protonmail.com>
+ * SPDX-License-Identifier: ISC
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ * Rebroadcast uevents to 0x4 netlink group from a single long-running
+ * process instead of executing helper.c for each uevent.
+ *
+ * usage: relay [-c] [-f fifo]
+ *
+ * By default uevents are read from the kernel. This is only safe when the
+ * device manager doesn't need to finish its work before programs see the
+ * uevent, e.g. when device nodes are created by devtmpfs. Otherwise let the
+ * device manager write uevents to a FIFO given by -f, one KEY=value per line
+ * and an empty line after each uevent.
+ *
+ * Uevents are relayed in batches ordered by SEQNUM. With -c, change uevents
+ * that are followed by another change of the same device within a batch are
+ * dropped.
+ */
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#define BATCH_MAX 256
+
+struct event {
+    char buf[8192];
+    size_t len;
+    size_t index;
+    unsigned long long seqnum;
+    const char *devpath;
+    const char *action;
+};
+
+static struct event events[BATCH_MAX];
+static struct event *batch[BATCH_MAX];
+static size_t batch_cnt;
+
+static const char *get_value(struct event *event, const char *key)
+{
+    size_t len = strlen(key);
+    char *pos;
+
+    for (pos = event->buf; pos < event->buf + event->len; pos += strlen(pos) + 1) {
+        if (strncmp(pos, key, len) == 0 && pos[len] == '=') {
+            return pos + len + 1;
+        }
+    }
+
+    return NULL;
+}
+
+static void add_event(struct event *event)
+{
+    const char *seqnum;
+
+    event->devpath = get_value(event, "DEVPATH");
+    event->action = get_value(event, "ACTION");
+    seqnum = get_value(event, "SEQNUM");
+
+    if (!event->devpath || !event->action) {
+        return;
+    }
+
+    event->seqnum = seqnum ? strtoull(seqnum, NULL, 10) : 0;
+    event->index = batch_cnt;
+    batch[batch_cnt++] = event;
+}
+
+// kernel uevents start with "action@devpath" which the 0x4 group omits
+static void read_kernel(int fd)
+{
+    struct sockaddr_nl sa;
+    struct event *event;
+    socklen_t sa_len;
+    ssize_t len;
+    size_t skip;
+
+    while (batch_cnt < BATCH_MAX) {
+        event = &events[batch_cnt];
+        sa_len = sizeof(sa);
+        len = recvfrom(fd, event->buf, sizeof(event->buf), MSG_DONTWAIT,
+                (struct sockaddr *)&sa, &sa_len);
+
+        if (len <= 0) {
+            break;
+        }
+
+        // only trust uevents sent by the kernel
+        if (sa.nl_pid != 0 || len == sizeof(event->buf)) {
+            continue;
+        }
+
+        skip = strnlen(event->buf, len) + 1;
+
+        if (skip >= (size_t)len || !strchr(event->buf, '@')) {
+            continue;
+        }
+
+        event->len = len - skip;
+        memmove(event->buf, event->buf + skip, event->len);
+        add_event(event);
+    }
+}
+
+static char fifo_buf[BATCH_MAX * 8192];
+static size_t fifo_len;
+
+static void read_fifo(int fd)
+{
+    struct event *event;
+    char *pos, *end, *stop, *line;
+    ssize_t len;
+    size_t cnt;
+
+    len = read(fd, fifo_buf + fifo_len, sizeof(fifo_buf) - fifo_len);
+
+    if (len > 0) {
+        fifo_len += len;
+    }
+
+    pos = fifo_buf;
+    end = fifo_buf + fifo_len;
+
+    while (batch_cnt < BATCH_MAX) {
+        while (pos < end && *pos == '\n') {
+            pos++;
+        }
+
+        stop = memmem(pos, end - pos, "\n\n", 2);
+
+        if (!stop) {
+            break;
+        }
+
+        event = &events[batch_cnt];
+        event->len = 0;
+
+        for (; pos <= stop; pos = line + 1) {
+            line = memchr(pos, '\n', stop + 1 - pos);
+            cnt = line - pos;
+
+            if (event->len + cnt + 1 <= sizeof(event->buf)) {
+                memcpy(event->buf + event->len, pos, cnt);
+                event->len += cnt;
+                event->buf[event->len++] = '\0';
+            }
+        }
+
+        pos = stop + 2;
+        add_event(event);
+    }
+
+    // keep incomplete uevent until the rest arrives, unless it can't fit
+    fifo_len = end - pos;
+
+    if (fifo_len == sizeof(fifo_buf)) {
+        fifo_len = 0;
+    }
+
+    memmove(fifo_buf, pos, fifo_len);
+}
+
+static int fifo_pending(void)
+{
+    return batch_cnt == 0 && memmem(fifo_buf, fifo_len, "\n\n", 2) != NULL;
+}
+
+static int cmp_event(const void *a, const void *b)
+{
+    const struct event *x = *(struct event *const *)a;
+    const struct event *y = *(struct event *const *)b;
+
+    if (x->seqnum != y->seqnum) {
+        return x->seqnum < y->seqnum ? -1 : 1;
+    }
+
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static void coalesce_batch(void)
+{
+    size_t i, j, cnt = 0;
+
+    for (i = 0; i < batch_cnt; i++) {
+        for (j = i + 1; j < batch_cnt; j++) {
+            if (strcmp(batch[i]->devpath, batch[j]->devpath) == 0) {
+                break;
+            }
+        }
+
+        if (j < batch_cnt && strcmp(batch[i]->action, "change") == 0 &&
+            strcmp(batch[j]->action, "change") == 0) {
+            continue;
+        }
+
+        batch[cnt++] = batch[i];
+    }
+
+    batch_cnt = cnt;
+}
+
+static void send_batch(int fd)
+{
+    static struct mmsghdr msg[BATCH_MAX];
+    static struct iovec iov[BATCH_MAX];
+    struct sockaddr_nl sa = {0};
+    size_t i;
+    int cnt;
+
+    sa.nl_family = AF_NETLINK;
+    sa.nl_groups = 0x4;
+
+    for (i = 0; i < batch_cnt; i++) {
+        iov[i].iov_base = batch[i]->buf;
+        iov[i].iov_len = batch[i]->len;
+
+        memset(&msg[i], 0, sizeof(msg[i]));
+        msg[i].msg_hdr.msg_name = &sa;
+        msg[i].msg_hdr.msg_namelen = sizeof(sa);
+        msg[i].msg_hdr.msg_iov = &iov[i];
+        msg[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    for (i = 0; i < batch_cnt; i += cnt) {
+        cnt = sendmmsg(fd, msg + i, batch_cnt - i, 0);
+
+        if (cnt == -1) {
+            if (errno == EINTR) {
+                cnt = 0;
+                continue;
+            }
+
+            // drop the uevent that failed, but keep relaying the rest
+            perror("sendmmsg");
+            cnt = 1;
+        }
+    }
+
+    batch_cnt = 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_nl sa = {0};
+    const char *fifo = NULL;
+    struct pollfd pfd;
+    int opt, fd, coalesce = 0;
+    int size = 8 * 1024 * 1024;
+
+    while ((opt = getopt(argc, argv, "cf:")) != -1) {
+        switch (opt) {
+        case 'c':
+            coalesce = 1;
+            break;
+        case 'f':
+            fifo = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-c] [-f fifo]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+
+    if (fd == -1) {
+        perror("socket");
+        return 1;
+    }
+
+    if (fifo) {
+        // opened for writing too, so that writers going away don't cause EOF
+        pfd.fd = open(fifo, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+        if (pfd.fd == -1) {
+            perror(fifo);
+            return 1;
+        }
+    }
+    else {
+        pfd.fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+        sa.nl_family = AF_NETLINK;
+        sa.nl_groups = 0x1;
+
+        if (pfd.fd == -1 || bind(pfd.fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+            perror("bind");
+            return 1;
+        }
+
+        // coldplug may trigger thousands of uevents at once
+        setsockopt(pfd.fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size));
+        setsockopt(pfd.fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+
+    pfd.events = POLLIN;
+
+    while (1) {
+        if (poll(&pfd, 1, fifo && fifo_pending() ? 0 : -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("poll");
+            return 1;
+        }
+
+        if (fifo) {
+            read_fifo(pfd.fd);
+        }
+        else {
+            read_kernel(pfd.fd);
+        }
+
+        qsort(batch, batch_cnt, sizeof(*batch), cmp_event);
+
+        if (coalesce) {
+            coalesce_batch();
+        }
+
+        send_batch(fd);
+    }
+}
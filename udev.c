@@ -15,13 +15,23 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stdint.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "udev.h"
+#include "udev_hash.h"
+#include "udev_private.h"
 
-struct udev {
-    int refcount;
-};
+static void free_providers(void *ptr)
+{
+    struct udev_provider *provider = ptr, *next;
+
+    for (; provider; provider = next) {
+        next = provider->next;
+        free(provider);
+    }
+}
 
 struct udev *udev_new(void)
 {
@@ -33,7 +43,26 @@ struct udev *udev_new(void)
         return NULL;
     }
 
+    udev_hash_init(&udev->providers);
+    udev_hash_init(&udev->id_cache);
+    udev_hash_init(&udev->path_cache);
+    udev_hash_init(&udev->scsi_hosts);
+    udev_hash_init(&udev->devlinks);
+    udev_hash_init(&udev->tags);
+    udev->devlinks_fd = -1;
+    udev->db.lock = -1;
     udev->refcount = 1;
+
+    if (pthread_mutex_init(&udev->lock, NULL) != 0) {
+        free(udev);
+        return NULL;
+    }
+
+    if (udev_add_builtin_providers(udev) == -1) {
+        udev_unref(udev);
+        return NULL;
+    }
+
     return udev;
 }
 
@@ -43,7 +72,7 @@ struct udev *udev_ref(struct udev *udev)
         return NULL;
     }
 
-    udev->refcount++;
+    __atomic_add_fetch(&udev->refcount, 1, __ATOMIC_RELAXED);
     return udev;
 }
 
@@ -53,45 +82,130 @@ struct udev *udev_unref(struct udev *udev)
         return NULL;
     }
 
-    if (--udev->refcount > 0) {
+    if (__atomic_sub_fetch(&udev->refcount, 1, __ATOMIC_ACQ_REL) > 0) {
         return udev;
     }
 
+    free_providers(udev->providers_any);
+    udev_hash_free(&udev->providers, free_providers);
+    udev_id_free(udev);
+    udev_path_free(udev);
+    udev_devlinks_free(udev);
+    udev_subsystems_free(udev);
+    udev_hash_free(&udev->tags, NULL);
+    udev_db_free(udev);
+    pthread_mutex_destroy(&udev->lock);
     free(udev);
     return NULL;
 }
 
-void udev_set_log_fn(struct udev *udev, void (*log_fn)(struct udev *udev,
-            int priority, const char *file, int line, const char *fn,
-            const char *format, va_list args))
+// providers are kept per subsystem, so that devices only pay for the
+// providers of their own subsystem
+int udev_add_provider(struct udev *udev, const char *subsystem,
+        void (*fn)(struct udev_device *udev_device, void *data), void *data, int builtin)
 {
+    struct udev_provider *provider, *head, **tail;
+
+    if (!udev || !fn) {
+        return -1;
+    }
+
+    provider = calloc(1, sizeof(*provider));
+
+    if (!provider) {
+        return -1;
+    }
+
+    provider->fn = fn;
+    provider->data = data;
+    provider->builtin = builtin;
+
+    if (subsystem) {
+        head = udev_hash_get(&udev->providers, subsystem);
+
+        if (!head) {
+            if (udev_hash_set(&udev->providers, subsystem, provider) == -1) {
+                free(provider);
+                return -1;
+            }
+
+            return 0;
+        }
+
+        tail = &head->next;
+    }
+    else {
+        tail = &udev->providers_any;
+    }
+
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+
+    *tail = provider;
+    return 0;
 }
 
-void udev_set_log_priority(struct udev *udev, int priority)
+int udev_add_property_provider(struct udev *udev, const char *subsystem,
+        void (*fn)(struct udev_device *udev_device, void *data), void *data)
 {
+    return udev_add_provider(udev, subsystem, fn, data, 0);
 }
 
-int udev_get_log_priority(struct udev *udev)
+// results of built-in providers are already stored in the database, so
+// devices read from it only run the providers added by the application
+void udev_run_providers(struct udev *udev, struct udev_device *udev_device, int builtin)
 {
-    return 0;
+    struct udev_provider *provider;
+    const char *subsystem;
+
+    subsystem = udev_device_get_subsystem(udev_device);
+
+    if (subsystem) {
+        for (provider = udev_hash_get(&udev->providers, subsystem); provider; provider = provider->next) {
+            if (builtin || !provider->builtin) {
+                provider->fn(udev_device, provider->data);
+            }
+        }
+    }
+
+    for (provider = udev->providers_any; provider; provider = provider->next) {
+        if (builtin || !provider->builtin) {
+            provider->fn(udev_device, provider->data);
+        }
+    }
 }
 
-/* XXX NOT IMPLEMENTED */ struct udev_hwdb *udev_hwdb_new(struct udev *udev)
+int udev_tag_index(struct udev *udev, const char *tag, int add)
 {
-    return NULL;
+    uintptr_t index;
+
+    pthread_mutex_lock(&udev->lock);
+    index = (uintptr_t)udev_hash_get(&udev->tags, tag);
+
+    if (!index && add && udev->tags.count < UDEV_TAG_MAX) {
+        index = udev->tags.count + 1;
+
+        if (udev_hash_set(&udev->tags, tag, (void *)index) == -1) {
+            index = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&udev->lock);
+    return (int)index - 1;
 }
 
-/* XXX NOT IMPLEMENTED */ struct udev_hwdb *udev_hwdb_ref(struct udev_hwdb *hwdb)
+void udev_set_log_fn(struct udev *udev, void (*log_fn)(struct udev *udev,
+            int priority, const char *file, int line, const char *fn,
+            const char *format, va_list args))
 {
-    return NULL;
 }
 
-/* XXX NOT IMPLEMENTED */ struct udev_hwdb *udev_hwdb_unref(struct udev_hwdb *hwdb)
+void udev_set_log_priority(struct udev *udev, int priority)
 {
-    return NULL;
 }
 
-/* XXX NOT IMPLEMENTED */ struct udev_list_entry *udev_hwdb_get_properties_list_entry(struct udev_hwdb *hwdb, const char *modalias, unsigned int flags)
+int udev_get_log_priority(struct udev *udev)
 {
-    return NULL;
+    return 0;
 }
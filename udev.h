@@ -132,6 +132,53 @@ struct udev_list_entry *udev_hwdb_get_properties_list_entry(struct udev_hwdb *hw
 // this is "libudev-zero" extension. do not use if portability is concern
 struct udev_device *udev_device_new_from_uevent(struct udev *udev, char *buf, size_t len);
 
+// this is "libudev-zero" extension. do not use if portability is concern
+//
+// fn is called for every new device of given subsystem(or every device if
+// subsystem is NULL) after the built-in properties are set. it may add
+// properties with udev_device_add_property() which must not be called
+// outside of fn.
+int udev_add_property_provider(struct udev *udev, const char *subsystem,
+        void (*fn)(struct udev_device *udev_device, void *data), void *data);
+int udev_device_add_property(struct udev_device *udev_device, const char *key, const char *value);
+
+// this is "libudev-zero" extension. do not use if portability is concern
+//
+// scan devices with up to threads workers. results and their order are the
+// same as with a serial scan, but property providers may be called from
+// several threads at once. 0 or 1 means serial scan, which is the default.
+int udev_enumerate_set_threads(struct udev_enumerate *udev_enumerate, int threads);
+
+// this is "libudev-zero" extension. do not use if portability is concern
+//
+// keep the result list current with "udev" monitor events, filtered the
+// same way as scanned devices. enable it before the scan to not miss
+// devices which appear meanwhile. once udev_enumerate_get_fd() is readable,
+// udev_enumerate_process() applies pending events and returns how many of
+// them changed the list or a device in it. every such event bumps the
+// generation and calls fn(if not NULL) with the device of the event. if
+// events were lost, the list is scanned again and fn gets NULL device.
+int udev_enumerate_enable_live(struct udev_enumerate *udev_enumerate,
+        void (*fn)(struct udev_enumerate *udev_enumerate, struct udev_device *udev_device, void *data), void *data);
+int udev_enumerate_get_fd(struct udev_enumerate *udev_enumerate);
+int udev_enumerate_process(struct udev_enumerate *udev_enumerate);
+unsigned long udev_enumerate_get_generation(struct udev_enumerate *udev_enumerate);
+
+// this is "libudev-zero" extension. do not use if portability is concern
+//
+// same as udev_device_new_from_syspath() for the syspath of list_entry, but
+// returns the device which was already built by the scan if there is one.
+// the caller owns the returned reference.
+struct udev_device *udev_enumerate_get_device(struct udev_enumerate *udev_enumerate, struct udev_list_entry *list_entry);
+
+// this is "libudev-zero" extension. do not use if portability is concern
+//
+// same as udev_enumerate_scan_devices(), but fn is called for every matching
+// device as soon as it is found instead of adding it to the list. the device
+// is unreferenced after fn returns. non-zero return value stops the scan.
+int udev_enumerate_scan_devices_cb(struct udev_enumerate *udev_enumerate,
+        int (*fn)(struct udev_device *udev_device, void *data), void *data);
+
 #ifdef __cplusplus
 }
 #endif
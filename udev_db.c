@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2020-2021 illiliti <illiliti@protonmail.com>
+ * SPDX-License-Identifier: ISC
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "udev.h"
+#include "udev_list.h"
+#include "udev_hash.h"
+#include "udev_private.h"
+
+// read side of the device database written by contrib/dbd.c. see there for
+// the layout. the database is only trusted while it was written during the
+// current boot by a writer which still holds the lock file, otherwise devices
+// are built from sysfs as usual.
+
+#ifndef UDEV_DB_PATH
+#define UDEV_DB_PATH "/run/libudev-zero/db"
+#endif
+
+#define UDEV_DB_LOCK UDEV_DB_PATH ".lock"
+
+#define DB_SIG "LUZUDEV1"
+#define DB_VERSION 2
+
+#define HEADER_VERSION 8
+#define HEADER_BOOT_ID 12
+#define HEADER_SIZE 52
+#define HEADER_COUNT 56
+#define HEADER_BUCKETS 60
+#define HEADER_RECORDS 64
+#define HEADER_STRINGS 68
+#define HEADER_MIN_SIZE 72
+
+#define RECORD_NEXT 0
+#define RECORD_HASH 4
+#define RECORD_SYSPATH 8
+#define RECORD_COUNT 12
+#define RECORD_SIZE 16
+
+static uint32_t get32(const unsigned char *ptr)
+{
+    uint32_t val;
+
+    memcpy(&val, ptr, sizeof(val));
+    return val;
+}
+
+static const char *get_string(struct udev_db *db, uint32_t off)
+{
+    // zero offset stands for a NULL value
+    if (off < HEADER_MIN_SIZE || off >= db->size) {
+        return NULL;
+    }
+
+    return (const char *)db->map + off;
+}
+
+static const unsigned char *get_record(struct udev_db *db, uint32_t off)
+{
+    const unsigned char *rec;
+
+    if (off < HEADER_MIN_SIZE || off > db->size - RECORD_SIZE) {
+        return NULL;
+    }
+
+    rec = db->map + off;
+
+    if (get32(rec + RECORD_COUNT) > (db->size - off - RECORD_SIZE) / 8) {
+        return NULL;
+    }
+
+    return rec;
+}
+
+static void unmap_db(struct udev_db *db)
+{
+    if (db->map) {
+        munmap((void *)db->map, db->size);
+    }
+
+    db->map = NULL;
+    db->size = 0;
+}
+
+static int read_boot_id(char *buf, size_t len)
+{
+    size_t cnt;
+    FILE *file;
+
+    file = fopen("/proc/sys/kernel/random/boot_id", "r");
+
+    if (!file) {
+        return -1;
+    }
+
+    cnt = fread(buf, 1, len - 1, file);
+    fclose(file);
+
+    while (cnt > 0 && buf[cnt - 1] == '\n') {
+        cnt--;
+    }
+
+    buf[cnt] = '\0';
+    return cnt > 0 ? 0 : -1;
+}
+
+static int map_db(struct udev_db *db, int fd, const struct stat *st)
+{
+    char boot_id[40];
+    uint32_t buckets;
+
+    if (st->st_size < HEADER_MIN_SIZE || read_boot_id(boot_id, sizeof(boot_id)) == -1) {
+        return -1;
+    }
+
+    db->map = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (db->map == MAP_FAILED) {
+        db->map = NULL;
+        return -1;
+    }
+
+    db->size = st->st_size;
+    db->dev = st->st_dev;
+    db->ino = st->st_ino;
+    buckets = get32(db->map + HEADER_BUCKETS);
+
+    // strings are looked up without bounds, so the file must end with NUL
+    if (memcmp(db->map, DB_SIG, 8) != 0 || get32(db->map + HEADER_VERSION) != DB_VERSION ||
+        get32(db->map + HEADER_SIZE) != db->size || db->map[db->size - 1] != '\0' ||
+        strncmp((const char *)db->map + HEADER_BOOT_ID, boot_id, 40) != 0 ||
+        buckets == 0 || (buckets & (buckets - 1)) != 0 ||
+        buckets > (db->size - HEADER_MIN_SIZE) / 4) {
+        unmap_db(db);
+        return -1;
+    }
+
+    return 0;
+}
+
+// the writer holds a write lock on the lock file while it runs. the lock
+// goes away with the writer, even if it is killed, and unlike a pid it can't
+// be mistaken for an unrelated process. locks are owned by the process and
+// closing any descriptor of the file drops them, so the descriptor is kept
+// open for the lifetime of the context.
+static int check_writer(struct udev_db *db)
+{
+    struct flock fl;
+
+    if (db->lock == -1) {
+        db->lock = open(UDEV_DB_LOCK, O_RDONLY | O_CLOEXEC);
+
+        if (db->lock == -1) {
+            return -1;
+        }
+    }
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_RDLCK;
+    fl.l_whence = SEEK_SET;
+
+    // locks of the calling process never conflict, so the writer doesn't
+    // read its own database
+    if (fcntl(db->lock, F_GETLK, &fl) == -1 || fl.l_type == F_UNLCK) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int check_db(struct udev *udev)
+{
+    struct udev_db *db = &udev->db;
+    struct stat st;
+    int fd;
+
+    // skip revalidation while a scan holds the database
+    if (db->pinned) {
+        return db->map ? 0 : -1;
+    }
+
+    // a dead writer means the database no longer follows uevents. lookups
+    // skip the database until the next scan checks for a writer again
+    if (check_writer(db) == -1) {
+        __atomic_store_n(&db->absent, 1, __ATOMIC_RELAXED);
+        unmap_db(db);
+        return -1;
+    }
+
+    // the writer replaces the file by rename, so a new inode means new data
+    if (stat(UDEV_DB_PATH, &st) == -1) {
+        unmap_db(db);
+        return -1;
+    }
+
+    if (db->map && db->dev == st.st_dev && db->ino == st.st_ino) {
+        return 0;
+    }
+
+    unmap_db(db);
+    fd = open(UDEV_DB_PATH, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    // the file may have been replaced once more since stat()
+    if (fstat(fd, &st) == -1 || map_db(db, fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+static const unsigned char *find_record(struct udev_db *db, const char *syspath)
+{
+    const unsigned char *rec;
+    uint32_t hash, off;
+    const char *path;
+
+    hash = (uint32_t)udev_hash_string(syspath);
+    off = get32(db->map + HEADER_MIN_SIZE + (hash & (get32(db->map + HEADER_BUCKETS) - 1)) * 4);
+
+    while ((rec = get_record(db, off))) {
+        path = get_string(db, get32(rec + RECORD_SYSPATH));
+
+        if (get32(rec + RECORD_HASH) == hash && path && strcmp(path, syspath) == 0) {
+            return rec;
+        }
+
+        off = get32(rec + RECORD_NEXT);
+    }
+
+    return NULL;
+}
+
+static int pin_db(struct udev *udev)
+{
+    int ret;
+
+    pthread_mutex_lock(&udev->lock);
+    ret = check_db(udev);
+
+    if (ret == 0) {
+        udev->db.pinned++;
+    }
+
+    pthread_mutex_unlock(&udev->lock);
+    return ret;
+}
+
+int udev_db_begin(struct udev *udev)
+{
+    __atomic_store_n(&udev->db.absent, 0, __ATOMIC_RELAXED);
+    return pin_db(udev);
+}
+
+void udev_db_end(struct udev *udev)
+{
+    pthread_mutex_lock(&udev->lock);
+    udev->db.pinned--;
+    pthread_mutex_unlock(&udev->lock);
+}
+
+const char *udev_db_next(struct udev *udev, uint32_t *pos)
+{
+    struct udev_db *db = &udev->db;
+    const unsigned char *rec;
+    uint32_t off;
+
+    off = *pos ? *pos : get32(db->map + HEADER_RECORDS);
+    rec = get_record(db, off);
+
+    if (!rec || off >= get32(db->map + HEADER_STRINGS)) {
+        return NULL;
+    }
+
+    *pos = off + RECORD_SIZE + get32(rec + RECORD_COUNT) * 8;
+    return get_string(db, get32(rec + RECORD_SYSPATH));
+}
+
+// syspath must be canonical. the map is pinned rather than locked, so that
+// threads building devices don't wait for each other
+int udev_db_get(struct udev *udev, const char *syspath, struct udev_list_entry *properties)
+{
+    struct udev_db *db = &udev->db;
+    const unsigned char *rec;
+    const char *key;
+    uint32_t i, cnt;
+
+    // without a writer a lookup costs neither a syscall nor the lock
+    if (__atomic_load_n(&db->absent, __ATOMIC_RELAXED) || pin_db(udev) == -1) {
+        return -1;
+    }
+
+    rec = find_record(db, syspath);
+
+    if (rec) {
+        cnt = get32(rec + RECORD_COUNT);
+
+        for (i = 0; i < cnt; i++) {
+            key = get_string(db, get32(rec + RECORD_SIZE + i * 8));
+
+            if (key) {
+                udev_list_entry_add(properties, key, get_string(db, get32(rec + RECORD_SIZE + i * 8 + 4)), 0);
+            }
+        }
+    }
+
+    udev_db_end(udev);
+    return rec ? 0 : -1;
+}
+
+void udev_db_free(struct udev *udev)
+{
+    unmap_db(&udev->db);
+
+    if (udev->db.lock != -1) {
+        close(udev->db.lock);
+    }
+}
@@ -16,19 +16,21 @@
  */
 
 #include <stdio.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <net/if.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <linux/input.h>
 
 #include "udev.h"
 #include "udev_list.h"
-
-#ifndef LINE_MAX
-#define LINE_MAX 2048
-#endif
+#include "udev_hash.h"
+#include "udev_private.h"
 
 #ifndef LONG_BIT
 #define LONG_BIT (sizeof(unsigned long) * 8)
@@ -52,11 +54,37 @@
 #define INPUT_PROP_CNT 0x20
 #endif
 
+#ifndef BTN_DPAD_UP
+#define BTN_DPAD_UP 0x220
+#endif
+
+#ifndef BTN_DPAD_RIGHT
+#define BTN_DPAD_RIGHT 0x223
+#endif
+
+#ifndef KEY_ALS_TOGGLE
+#define KEY_ALS_TOGGLE 0x230
+#endif
+
+// properties and tags are set up before the device is handed out and never
+// change afterwards. parent, sysattrs and devlinks are filled on demand, so
+// that a device can be shared across threads: the parent is published with
+// compare-and-swap, the lists are filled under lock. sysattr values may be
+// held by other threads, so replaced ones are kept in sysattrs_old until the
+// device is freed.
 struct udev_device {
     struct udev_list_entry properties;
     struct udev_list_entry sysattrs;
+    struct udev_list_entry sysattrs_old;
+    struct udev_list_entry devlinks;
+    struct udev_list_entry current_tags;
+    struct udev_list_entry tags;
     struct udev_device *parent;
     struct udev *udev;
+    uint64_t current_tag_mask;
+    uint64_t tag_mask;
+    pthread_mutex_t lock;
+    int devlinks_read;
     int refcount;
 };
 
@@ -139,14 +167,17 @@ struct udev *udev_device_get_udev(struct udev_device *udev_device)
 
 struct udev_device *udev_device_get_parent(struct udev_device *udev_device)
 {
+    struct udev_device *parent = NULL, *parent2 = NULL;
     char *pos, *path, *syspath;
 
     if (!udev_device) {
         return NULL;
     }
 
-    if (udev_device->parent) {
-        return udev_device->parent;
+    parent2 = __atomic_load_n(&udev_device->parent, __ATOMIC_ACQUIRE);
+
+    if (parent2) {
+        return parent2;
     }
 
     syspath = strdup(udev_device_get_syspath(udev_device));
@@ -165,12 +196,20 @@ struct udev_device *udev_device_get_parent(struct udev_device *udev_device)
             break;
         }
 
-        udev_device->parent = udev_device_new_from_syspath(udev_device->udev, syspath);
+        parent = udev_device_new_from_syspath(udev_device->udev, syspath);
     }
-    while (!udev_device->parent);
+    while (!parent);
 
     free(syspath);
-    return udev_device->parent;
+
+    // another thread may have been faster, its parent wins
+    if (parent && !__atomic_compare_exchange_n(&udev_device->parent, &parent2, parent, 0,
+                                               __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        udev_device_unref(parent);
+        return parent2;
+    }
+
+    return parent;
 }
 
 struct udev_device *udev_device_get_parent_with_subsystem_devtype(struct udev_device *udev_device, const char *subsystem, const char *devtype)
@@ -208,14 +247,85 @@ const char *udev_device_get_action(struct udev_device *udev_device)
     return udev_device_get_property_value(udev_device, "ACTION");
 }
 
-/* XXX NOT IMPLEMENTED */ int udev_device_has_tag(struct udev_device *udev_device, const char *tag)
+int udev_device_has_tag(struct udev_device *udev_device, const char *tag)
 {
-    return 0;
+    int index;
+
+    if (!udev_device || !tag) {
+        return 0;
+    }
+
+    index = udev_tag_index(udev_device->udev, tag, 0);
+
+    if (index == -1) {
+        return !!udev_list_entry_get_by_name(&udev_device->tags, tag);
+    }
+
+    return !!(udev_device->tag_mask & ((uint64_t)1 << index));
 }
 
-/* XXX NOT IMPLEMENTED */ struct udev_list_entry *udev_device_get_devlinks_list_entry(struct udev_device *udev_device)
+uint64_t udev_device_get_tag_mask(struct udev_device *udev_device)
 {
-    return NULL;
+    return udev_device->tag_mask;
+}
+
+static void read_devlinks(struct udev_device *udev_device)
+{
+    const char *subsystem, *devlinks, *major, *minor;
+    char id[64], link[PATH_MAX];
+    size_t len;
+
+    devlinks = udev_device_get_property_value(udev_device, "DEVLINKS");
+
+    // uevents rebroadcasted by udevd already carry space separated links
+    if (devlinks) {
+        while (*devlinks) {
+            len = strcspn(devlinks, " ");
+
+            if (len > 0 && len < sizeof(link)) {
+                memcpy(link, devlinks, len);
+                link[len] = '\0';
+                udev_list_entry_add(&udev_device->devlinks, link, NULL, 0);
+            }
+
+            devlinks += len + (devlinks[len] == ' ');
+        }
+
+        return;
+    }
+
+    subsystem = udev_device_get_subsystem(udev_device);
+    major = udev_device_get_property_value(udev_device, "MAJOR");
+    minor = udev_device_get_property_value(udev_device, "MINOR");
+
+    if (!subsystem || !major || !minor) {
+        return;
+    }
+
+    snprintf(id, sizeof(id), "%c%s:%s", strcmp(subsystem, "block") == 0 ? 'b' : 'c', major, minor);
+
+    udev_devlinks_get(udev_device->udev, id, &udev_device->devlinks);
+}
+
+struct udev_list_entry *udev_device_get_devlinks_list_entry(struct udev_device *udev_device)
+{
+    if (!udev_device) {
+        return NULL;
+    }
+
+    if (__atomic_load_n(&udev_device->devlinks_read, __ATOMIC_ACQUIRE)) {
+        return udev_list_entry_get_next(&udev_device->devlinks);
+    }
+
+    pthread_mutex_lock(&udev_device->lock);
+
+    if (!udev_device->devlinks_read) {
+        read_devlinks(udev_device);
+        __atomic_store_n(&udev_device->devlinks_read, 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&udev_device->lock);
+    return udev_list_entry_get_next(&udev_device->devlinks);
 }
 
 struct udev_list_entry *udev_device_get_properties_list_entry(struct udev_device *udev_device)
@@ -223,19 +333,19 @@ struct udev_list_entry *udev_device_get_properties_list_entry(struct udev_device
     return udev_device ? udev_list_entry_get_next(&udev_device->properties) : NULL;
 }
 
-/* XXX NOT IMPLEMENTED */ struct udev_list_entry *udev_device_get_tags_list_entry(struct udev_device *udev_device)
+struct udev_list_entry *udev_device_get_tags_list_entry(struct udev_device *udev_device)
 {
-    return NULL;
+    return udev_device ? udev_list_entry_get_next(&udev_device->tags) : NULL;
 }
 
-/* XXX NOT IMPLEMENTED */ struct udev_list_entry *udev_device_get_current_tags_list_entry(struct udev_device *udev_device)
+struct udev_list_entry *udev_device_get_current_tags_list_entry(struct udev_device *udev_device)
 {
-    return NULL;
+    return udev_device ? udev_list_entry_get_next(&udev_device->current_tags) : NULL;
 }
 
 struct udev_list_entry *udev_device_get_sysattr_list_entry(struct udev_device *udev_device)
 {
-    return udev_device ? udev_list_entry_get_next(&udev_device->sysattrs) : NULL;
+    return udev_device ? __atomic_load_n(&udev_device->sysattrs.next, __ATOMIC_ACQUIRE) : NULL;
 }
 
 const char *udev_device_get_property_value(struct udev_device *udev_device, const char *key)
@@ -247,6 +357,24 @@ const char *udev_device_get_property_value(struct udev_device *udev_device, cons
     return udev_list_entry_get_value(udev_list_entry_get_by_name(&udev_device->properties, key));
 }
 
+// caller holds the lock. entries are published with release semantics for
+// readers which walk the list without it
+static struct udev_list_entry *add_sysattr(struct udev_device *udev_device, const char *sysattr, const char *value)
+{
+    struct udev_list_entry head, *list_entry;
+
+    udev_list_entry_init(&head);
+    list_entry = udev_list_entry_add(&head, sysattr, value, 0);
+
+    if (!list_entry) {
+        return NULL;
+    }
+
+    list_entry->next = udev_device->sysattrs.next;
+    __atomic_store_n(&udev_device->sysattrs.next, list_entry, __ATOMIC_RELEASE);
+    return list_entry;
+}
+
 const char *udev_device_get_sysattr_value(struct udev_device *udev_device, const char *sysattr)
 {
     struct udev_list_entry *list_entry;
@@ -259,7 +387,9 @@ const char *udev_device_get_sysattr_value(struct udev_device *udev_device, const
         return NULL;
     }
 
+    pthread_mutex_lock(&udev_device->lock);
     list_entry = udev_list_entry_get_by_name(&udev_device->sysattrs, sysattr);
+    pthread_mutex_unlock(&udev_device->lock);
 
     if (list_entry) {
         return udev_list_entry_get_value(list_entry);
@@ -293,12 +423,21 @@ const char *udev_device_get_sysattr_value(struct udev_device *udev_device, const
         data[len] = '\0';
     }
 
-    list_entry = udev_list_entry_add(&udev_device->sysattrs, sysattr, data, 0);
+    // read without lock, the value of whoever came first is kept
+    pthread_mutex_lock(&udev_device->lock);
+    list_entry = udev_list_entry_get_by_name(&udev_device->sysattrs, sysattr);
+
+    if (!list_entry) {
+        list_entry = add_sysattr(udev_device, sysattr, data);
+    }
+
+    pthread_mutex_unlock(&udev_device->lock);
     return udev_list_entry_get_value(list_entry);
 }
 
 int udev_device_set_sysattr_value(struct udev_device *udev_device, const char *sysattr, const char *value)
 {
+    struct udev_list_entry *list_entry, *old;
     char path[PATH_MAX];
     struct stat st;
     size_t len;
@@ -329,17 +468,33 @@ int udev_device_set_sysattr_value(struct udev_device *udev_device, const char *s
     }
 
     fclose(file);
-    udev_list_entry_add(&udev_device->sysattrs, sysattr, value, 1);
+
+    pthread_mutex_lock(&udev_device->lock);
+    list_entry = add_sysattr(udev_device, sysattr, value);
+
+    // the new entry shadows the previous one, which is unlinked but not
+    // freed, its value may have been returned to another thread
+    while (list_entry && (old = udev_list_entry_get_next(list_entry))) {
+        if (strcmp(udev_list_entry_get_name(old), sysattr) == 0) {
+            __atomic_store_n(&list_entry->next, old->next, __ATOMIC_RELEASE);
+            old->next = udev_device->sysattrs_old.next;
+            udev_device->sysattrs_old.next = old;
+            break;
+        }
+
+        list_entry = old;
+    }
+
+    pthread_mutex_unlock(&udev_device->lock);
     return 0;
 }
 
-static char *read_symlink(const char *syspath, const char *name)
+static char *read_symlink(int fd, const char *name)
 {
-    char link[PATH_MAX], path[PATH_MAX];
+    char link[PATH_MAX];
     ssize_t len;
 
-    snprintf(path, sizeof(path), "%s/%s", syspath, name);
-    len = readlink(path, link, sizeof(link));
+    len = readlinkat(fd, name, link, sizeof(link) - 1);
 
     if (len == -1) {
         return NULL;
@@ -349,21 +504,35 @@ static char *read_symlink(const char *syspath, const char *name)
     return strdup(strrchr(link, '/') + 1);
 }
 
-static int set_properties_from_uevent(struct udev_device *udev_device, const char *syspath)
+// uevent is a sysfs attribute, so it fits into a page and comes with a
+// single read(). that spares stdio its buffer allocation and extra calls
+static int set_properties_from_uevent(struct udev_device *udev_device, int fd)
 {
-    char line[LINE_MAX], path[PATH_MAX + sizeof("/uevent")], devnode[PATH_MAX];
-    FILE *file;
-    char *pos;
+    char buf[4096], devnode[PATH_MAX];
+    char *line, *end, *pos;
+    ssize_t len;
 
-    snprintf(path, sizeof(path), "%s/uevent", syspath);
-    file = fopen(path, "r");
+    fd = openat(fd, "uevent", O_RDONLY | O_CLOEXEC);
 
-    if (!file) {
+    if (fd == -1) {
+        return -1;
+    }
+
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+
+    if (len == -1) {
         return -1;
     }
 
-    while (fgets(line, sizeof(line), file)) {
-        line[strlen(line) - 1] = '\0';
+    buf[len] = '\0';
+
+    for (line = buf; *line; line = end) {
+        end = line + strcspn(line, "\n");
+
+        if (*end) {
+            *end++ = '\0';
+        }
 
         if (strncmp(line, "DEVNAME=", 8) == 0) {
             snprintf(devnode, sizeof(devnode), "/dev/%s", line + 8);
@@ -375,55 +544,315 @@ static int set_properties_from_uevent(struct udev_device *udev_device, const cha
         }
     }
 
-    fclose(file);
     return 0;
 }
 
-static void make_bit(unsigned long *arr, int cnt, const char *str)
+// the kernel prints bitmaps as space separated hex words, most significant
+// word first. decoding is done with a lookup table instead of strtoul to
+// avoid locale handling and rescanning of the string.
+// https://github.com/torvalds/linux/blob/f5b6eb1e018203913dfefcf6fa988649ad11ad6e/drivers/input/input.c#L1451
+static const unsigned char hex_table[256] = {
+    ['0'] = 1,  ['1'] = 2,  ['2'] = 3,  ['3'] = 4,  ['4'] = 5,
+    ['5'] = 6,  ['6'] = 7,  ['7'] = 8,  ['8'] = 9,  ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+static void make_bit(unsigned long *arr, size_t cnt, const char *str)
 {
-    size_t len;
-    int i;
+    const unsigned char *pos;
+    unsigned long word;
+    size_t i;
 
     if (!str) {
         return;
     }
 
-    for (i = 0, len = strlen(str); len > 0; len--) {
-        if (str[len] == ' ') {
-            arr[i++] = strtoul(str + len + 1, NULL, 16);
+    for (i = 1, pos = (const unsigned char *)str; *pos; pos++) {
+        i += *pos == ' ';
+    }
 
-            if (i == cnt) {
-                return;
-            }
+    for (pos = (const unsigned char *)str; i-- > 0; pos++) {
+        for (word = 0; hex_table[*pos]; pos++) {
+            word = (word << 4) | (hex_table[*pos] - 1);
+        }
+
+        if (i < cnt) {
+            arr[i] = word;
         }
-    }
 
-    arr[i] = strtoul(str, NULL, 16);
+        if (*pos != ' ') {
+            return;
+        }
+    }
 }
 
-static int test_bit(unsigned long *arr, unsigned long bit)
+static int test_bit(const unsigned long *arr, unsigned long bit)
 {
     return !!(arr[BIT_WORD(bit)] & BIT_MASK(bit));
 }
 
-static void set_properties_from_evdev(struct udev_device *udev_device)
+static unsigned long range_mask(unsigned long word, unsigned long first, unsigned long last)
+{
+    unsigned long mask = ~0UL;
+
+    if (word == BIT_WORD(first)) {
+        mask &= ~0UL << (first % LONG_BIT);
+    }
+
+    if (word == BIT_WORD(last)) {
+        mask &= ~0UL >> (LONG_BIT - 1 - last % LONG_BIT);
+    }
+
+    return mask;
+}
+
+// test whether any bit in [first, last] is set, one word at a time
+static int test_any(const unsigned long *arr, unsigned long first, unsigned long last)
 {
+    unsigned long word;
+
+    for (word = BIT_WORD(first); word <= BIT_WORD(last); word++) {
+        if (arr[word] & range_mask(word, first, last)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// test whether every bit in [first, last] is set
+static int test_all(const unsigned long *arr, unsigned long first, unsigned long last)
+{
+    unsigned long word, mask;
+
+    for (word = BIT_WORD(first); word <= BIT_WORD(last); word++) {
+        mask = range_mask(word, first, last);
+
+        if ((arr[word] & mask) != mask) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static size_t count_bits(const unsigned long *arr, unsigned long first, unsigned long last)
+{
+    unsigned long word, bits;
+    size_t cnt = 0;
+
+    for (word = BIT_WORD(first); word <= BIT_WORD(last); word++) {
+        for (bits = arr[word] & range_mask(word, first, last); bits; bits &= bits - 1) {
+            cnt++;
+        }
+    }
+
+    return cnt;
+}
+
+enum {
+    INPUT_KEY = 1 << 0,
+    INPUT_KEYBOARD = 1 << 1,
+    INPUT_MOUSE = 1 << 2,
+    INPUT_POINTINGSTICK = 1 << 3,
+    INPUT_TOUCHPAD = 1 << 4,
+    INPUT_TOUCHSCREEN = 1 << 5,
+    INPUT_TABLET = 1 << 6,
+    INPUT_TABLET_PAD = 1 << 7,
+    INPUT_JOYSTICK = 1 << 8,
+    INPUT_ACCELEROMETER = 1 << 9,
+    INPUT_SWITCH = 1 << 10,
+};
+
+static const struct {
+    int flag;
+    const char *property;
+} input_properties[] = {
+    { INPUT_KEY, "ID_INPUT_KEY" },
+    { INPUT_KEYBOARD, "ID_INPUT_KEYBOARD" },
+    { INPUT_MOUSE, "ID_INPUT_MOUSE" },
+    { INPUT_POINTINGSTICK, "ID_INPUT_POINTINGSTICK" },
+    { INPUT_TOUCHPAD, "ID_INPUT_TOUCHPAD" },
+    { INPUT_TOUCHSCREEN, "ID_INPUT_TOUCHSCREEN" },
+    { INPUT_TABLET, "ID_INPUT_TABLET" },
+    { INPUT_TABLET_PAD, "ID_INPUT_TABLET_PAD" },
+    { INPUT_JOYSTICK, "ID_INPUT_JOYSTICK" },
+    { INPUT_ACCELEROMETER, "ID_INPUT_ACCELEROMETER" },
+    { INPUT_SWITCH, "ID_INPUT_SWITCH" },
+};
+
+struct input_bits {
     // https://kernel.org/doc/html/latest/driver-api/input.html#c.input_dev
-    unsigned long prop_bits[BITS_TO_LONGS(INPUT_PROP_CNT)] = {0};
-    unsigned long abs_bits[BITS_TO_LONGS(ABS_CNT)] = {0};
-    unsigned long rel_bits[BITS_TO_LONGS(REL_CNT)] = {0};
-    unsigned long key_bits[BITS_TO_LONGS(KEY_CNT)] = {0};
-    unsigned long ev_bits[BITS_TO_LONGS(EV_CNT)] = {0};
-    struct udev_device *parent;
-    const char *subsystem;
-    unsigned long bit;
+    unsigned long prop[BITS_TO_LONGS(INPUT_PROP_CNT)];
+    unsigned long abs[BITS_TO_LONGS(ABS_CNT)];
+    unsigned long rel[BITS_TO_LONGS(REL_CNT)];
+    unsigned long key[BITS_TO_LONGS(KEY_CNT)];
+    unsigned long ev[BITS_TO_LONGS(EV_CNT)];
+    unsigned long bustype;
+};
 
-    subsystem = udev_device_get_subsystem(udev_device);
+// keys which joysticks don't have, the same list as input_id uses
+static size_t count_keyboard_keys(const struct input_bits *bits)
+{
+    static const unsigned short keys[] = {
+        KEY_LEFTCTRL, KEY_CAPSLOCK, KEY_NUMLOCK, KEY_INSERT, KEY_MUTE,
+        KEY_CALC, KEY_FILE, KEY_MAIL, KEY_PLAYPAUSE, KEY_BRIGHTNESSDOWN,
+    };
+    size_t i, cnt = 0;
 
-    if (!subsystem || strcmp(subsystem, "input") != 0) {
-        return;
+    if (!test_bit(bits->ev, EV_KEY)) {
+        return 0;
     }
 
+    for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        cnt += test_bit(bits->key, keys[i]) != 0;
+    }
+
+    return cnt;
+}
+
+// mirrors the classification rules of systemd's input_id builtin
+// https://github.com/systemd/systemd/blob/v251/src/udev/udev-builtin-input_id.c
+static int classify_pointer(const struct input_bits *bits)
+{
+    int has_abs, has_3d, has_mt, has_rel, has_stylus, has_pen, has_touch;
+    int has_mouse_button, has_joystick, has_pad_buttons, has_wheel;
+    int is_direct, finger_but_no_pen, flags = 0;
+    size_t buttons, axes;
+
+    has_abs = test_bit(bits->abs, ABS_X) && test_bit(bits->abs, ABS_Y);
+    has_3d = has_abs && test_bit(bits->abs, ABS_Z);
+
+    if (test_bit(bits->prop, INPUT_PROP_ACCELEROMETER) ||
+        (has_3d && !test_bit(bits->ev, EV_KEY))) {
+        return INPUT_ACCELEROMETER;
+    }
+
+    has_stylus = test_bit(bits->key, BTN_STYLUS);
+    has_pen = test_bit(bits->key, BTN_TOOL_PEN);
+    has_touch = test_bit(bits->key, BTN_TOUCH);
+    is_direct = test_bit(bits->prop, INPUT_PROP_DIRECT);
+    finger_but_no_pen = test_bit(bits->key, BTN_TOOL_FINGER) && !has_pen;
+    has_mouse_button = test_any(bits->key, BTN_MOUSE, BTN_JOYSTICK - 1);
+    has_rel = test_bit(bits->ev, EV_REL) && test_bit(bits->rel, REL_X) && test_bit(bits->rel, REL_Y);
+    has_wheel = test_bit(bits->ev, EV_REL) && (test_bit(bits->rel, REL_WHEEL) || test_bit(bits->rel, REL_HWHEEL));
+    has_pad_buttons = test_bit(bits->key, BTN_0) && has_stylus && !has_pen;
+
+    // devices which claim to have every abs axis are not multitouch
+    has_mt = test_bit(bits->abs, ABS_MT_POSITION_X) && test_bit(bits->abs, ABS_MT_POSITION_Y) &&
+        !(test_bit(bits->abs, ABS_MT_SLOT) && test_bit(bits->abs, ABS_MT_SLOT - 1));
+
+    // mice with more than 16 buttons run into the joystick range
+    has_joystick = (!test_bit(bits->key, BTN_JOYSTICK - 1) &&
+            (test_any(bits->key, BTN_JOYSTICK, BTN_DIGI - 1) ||
+             test_any(bits->key, BTN_TRIGGER_HAPPY1, BTN_TRIGGER_HAPPY40) ||
+             test_any(bits->key, BTN_DPAD_UP, BTN_DPAD_RIGHT))) ||
+        test_any(bits->abs, ABS_RX, ABS_PRESSURE - 1);
+
+    if (has_abs) {
+        if (has_stylus || has_pen) {
+            flags |= INPUT_TABLET;
+        }
+        else if (finger_but_no_pen && !is_direct) {
+            flags |= INPUT_TOUCHPAD;
+        }
+        else if (has_mouse_button) {
+            // VMware's USB mouse has absolute axes, but no touch/pressure button
+            flags |= INPUT_MOUSE;
+        }
+        else if (has_touch || is_direct) {
+            flags |= INPUT_TOUCHSCREEN;
+        }
+        else if (has_joystick) {
+            flags |= INPUT_JOYSTICK;
+        }
+    }
+    else if (has_joystick) {
+        flags |= INPUT_JOYSTICK;
+    }
+
+    if (has_mt) {
+        if (has_stylus || has_pen) {
+            flags |= INPUT_TABLET;
+        }
+        else if (finger_but_no_pen && !is_direct) {
+            flags |= INPUT_TOUCHPAD;
+        }
+        else if (has_touch || is_direct) {
+            flags |= INPUT_TOUCHSCREEN;
+        }
+    }
+
+    if ((flags & INPUT_TABLET) && has_pad_buttons) {
+        flags |= INPUT_TABLET_PAD;
+    }
+
+    if (has_pad_buttons && has_wheel && !has_rel) {
+        flags |= INPUT_TABLET | INPUT_TABLET_PAD;
+    }
+
+    if (!(flags & (INPUT_TABLET | INPUT_TOUCHPAD | INPUT_JOYSTICK)) &&
+        has_mouse_button && (has_rel || !has_abs)) {
+        flags |= INPUT_MOUSE;
+    }
+
+    // there is no such thing as an i2c mouse
+    if ((flags & INPUT_MOUSE) && bits->bustype == BUS_I2C) {
+        flags |= INPUT_POINTINGSTICK;
+    }
+
+    if (test_bit(bits->prop, INPUT_PROP_POINTING_STICK)) {
+        flags |= INPUT_POINTINGSTICK;
+    }
+
+    // some keyboards have joystick buttons, count them as keyboards
+    if (flags & INPUT_JOYSTICK) {
+        buttons = count_bits(bits->key, BTN_JOYSTICK, BTN_DIGI - 1) +
+            count_bits(bits->key, BTN_TRIGGER_HAPPY1, BTN_TRIGGER_HAPPY40) +
+            count_bits(bits->key, BTN_DPAD_UP, BTN_DPAD_RIGHT);
+        axes = count_bits(bits->abs, ABS_RX, ABS_PRESSURE - 1) + (has_abs ? 2 + has_3d : 0);
+
+        if (count_keyboard_keys(bits) >= 4 || buttons + axes < 2) {
+            flags &= ~INPUT_JOYSTICK;
+        }
+    }
+
+    return flags;
+}
+
+static int classify_key(const struct input_bits *bits)
+{
+    int flags = 0;
+
+    if (!test_bit(bits->ev, EV_KEY)) {
+        return 0;
+    }
+
+    // only KEY_* codes count here, BTN_* codes are handled by classify_pointer()
+    // https://github.com/torvalds/linux/blob/f5b6eb1e018203913dfefcf6fa988649ad11ad6e/include/uapi/linux/input-event-codes.h#L76-L338
+    if (test_any(bits->key, KEY_ESC, BTN_MISC - 1) ||
+        test_any(bits->key, KEY_OK, BTN_DPAD_UP - 1) ||
+        test_any(bits->key, KEY_ALS_TOGGLE, BTN_TRIGGER_HAPPY - 1)) {
+        flags |= INPUT_KEY;
+    }
+
+    // ESC, numbers and Q to D make a full keyboard
+    if (test_all(bits->key, KEY_ESC, KEY_S)) {
+        flags |= INPUT_KEYBOARD;
+    }
+
+    return flags;
+}
+
+static void set_properties_from_evdev(struct udev_device *udev_device, void *data)
+{
+    struct input_bits bits;
+    struct udev_device *parent;
+    const char *product;
+    int flags;
+    size_t i;
+
     parent = udev_device;
 
     while (1) {
@@ -438,137 +867,213 @@ static void set_properties_from_evdev(struct udev_device *udev_device)
         parent = udev_device_get_parent_with_subsystem_devtype(parent, "input", NULL);
     }
 
-    make_bit(ev_bits, sizeof(ev_bits) / sizeof(ev_bits[0]), udev_device_get_property_value(parent, "EV"));
-    make_bit(abs_bits, sizeof(abs_bits) / sizeof(abs_bits[0]), udev_device_get_property_value(parent, "ABS"));
-    make_bit(rel_bits, sizeof(rel_bits) / sizeof(rel_bits[0]), udev_device_get_property_value(parent, "REL"));
-    make_bit(key_bits, sizeof(key_bits) / sizeof(key_bits[0]), udev_device_get_property_value(parent, "KEY"));
-    make_bit(prop_bits, sizeof(prop_bits) / sizeof(prop_bits[0]), udev_device_get_property_value(parent, "PROP"));
+    memset(&bits, 0, sizeof(bits));
+    make_bit(bits.ev, sizeof(bits.ev) / sizeof(bits.ev[0]), udev_device_get_property_value(parent, "EV"));
+    make_bit(bits.abs, sizeof(bits.abs) / sizeof(bits.abs[0]), udev_device_get_property_value(parent, "ABS"));
+    make_bit(bits.rel, sizeof(bits.rel) / sizeof(bits.rel[0]), udev_device_get_property_value(parent, "REL"));
+    make_bit(bits.key, sizeof(bits.key) / sizeof(bits.key[0]), udev_device_get_property_value(parent, "KEY"));
+    make_bit(bits.prop, sizeof(bits.prop) / sizeof(bits.prop[0]), udev_device_get_property_value(parent, "PROP"));
 
-    udev_list_entry_add(&udev_device->properties, "ID_INPUT", "1", 0);
+    // PRODUCT=bustype/vendor/product/version
+    product = udev_device_get_property_value(parent, "PRODUCT");
+    bits.bustype = product ? strtoul(product, NULL, 16) : 0;
 
-    if (test_bit(prop_bits, INPUT_PROP_POINTING_STICK)) {
-        udev_list_entry_add(&udev_device->properties, "ID_INPUT_POINTINGSTICK", "1", 0);
-    }
+    flags = classify_pointer(&bits);
+    flags |= classify_key(&bits);
 
-    if (test_bit(prop_bits, INPUT_PROP_ACCELEROMETER)) {
-        udev_list_entry_add(&udev_device->properties, "ID_INPUT_ACCELEROMETER", "1", 0);
+    // some evdev nodes have only a scrollwheel
+    if (!flags && test_bit(bits.ev, EV_REL) &&
+        (test_bit(bits.rel, REL_WHEEL) || test_bit(bits.rel, REL_HWHEEL))) {
+        flags |= INPUT_KEY;
     }
 
-    if (test_bit(ev_bits, EV_SW)) {
-        udev_list_entry_add(&udev_device->properties, "ID_INPUT_SWITCH", "1", 0);
+    if (test_bit(bits.ev, EV_SW)) {
+        flags |= INPUT_SWITCH;
     }
 
-    if (test_bit(ev_bits, EV_ABS)) {
-        if (test_bit(key_bits, BTN_SELECT) || test_bit(key_bits, BTN_TR) ||
-            test_bit(key_bits, BTN_START) || test_bit(key_bits, BTN_TL)) {
-            if (test_bit(key_bits, BTN_TOUCH)) {
-                udev_list_entry_add(&udev_device->properties, "ID_INPUT_TOUCHSCREEN", "1", 0);
-            }
-            else {
-                udev_list_entry_add(&udev_device->properties, "ID_INPUT_JOYSTICK", "1", 0);
-            }
-        }
-        else if (test_bit(abs_bits, ABS_Y) && test_bit(abs_bits, ABS_X)) {
-            if (test_bit(abs_bits, ABS_Z) && !test_bit(ev_bits, EV_KEY)) {
-                udev_list_entry_add(&udev_device->properties, "ID_INPUT_ACCELEROMETER", "1", 0);
-            }
-            else if (test_bit(key_bits, BTN_STYLUS) || test_bit(key_bits, BTN_TOOL_PEN)) {
-                udev_list_entry_add(&udev_device->properties, "ID_INPUT_TABLET", "1", 0);
-            }
-            else if (test_bit(key_bits, BTN_TOUCH)) {
-                if (test_bit(key_bits, BTN_TOOL_FINGER)) {
-                    udev_list_entry_add(&udev_device->properties, "ID_INPUT_TOUCHPAD", "1", 0);
-                }
-                else {
-                    udev_list_entry_add(&udev_device->properties, "ID_INPUT_TOUCHSCREEN", "1", 0);
-                }
-            }
-            else if (test_bit(key_bits, BTN_MOUSE)) {
-                udev_list_entry_add(&udev_device->properties, "ID_INPUT_MOUSE", "1", 0);
-            }
-        }
-    }
-    else if (test_bit(ev_bits, EV_REL)) {
-        if (test_bit(rel_bits, REL_Y) && test_bit(rel_bits, REL_X) &&
-            test_bit(key_bits, BTN_MOUSE)) {
-            udev_list_entry_add(&udev_device->properties, "ID_INPUT_MOUSE", "1", 0);
+    udev_list_entry_add(&udev_device->properties, "ID_INPUT", "1", 0);
+
+    for (i = 0; i < sizeof(input_properties) / sizeof(input_properties[0]); i++) {
+        if (flags & input_properties[i].flag) {
+            udev_list_entry_add(&udev_device->properties, input_properties[i].property, "1", 0);
         }
     }
+}
 
-    if (!test_bit(ev_bits, EV_KEY)) {
+// TAGS=:seat:uaccess:
+static void set_tags(struct udev_device *udev_device, const char *key, struct udev_list_entry *list_entry, uint64_t *mask)
+{
+    const char *tags;
+    char tag[256];
+    size_t len;
+    int index;
+
+    tags = udev_device_get_property_value(udev_device, key);
+
+    if (!tags) {
         return;
     }
 
-    // iterate over key bits until BTN_* block is hit and test if bitmask has KEY_*.
-    // this way, we can check if device has keys or buttons.
-    // https://github.com/torvalds/linux/blob/f5b6eb1e018203913dfefcf6fa988649ad11ad6e/include/uapi/linux/input-event-codes.h#L76-L338
-    for (bit = KEY_ESC; bit < BTN_MISC; bit++) {
-        if (!test_bit(key_bits, bit)) {
-            continue;
-        }
+    while (*tags) {
+        len = strcspn(tags, ":");
+
+        if (len > 0 && len < sizeof(tag)) {
+            memcpy(tag, tags, len);
+            tag[len] = '\0';
+
+            if (!udev_list_entry_get_by_name(list_entry, tag)) {
+                udev_list_entry_add(list_entry, tag, NULL, 0);
+            }
 
-        udev_list_entry_add(&udev_device->properties, "ID_INPUT_KEY", "1", 0);
+            index = udev_tag_index(udev_device->udev, tag, 1);
 
-        if (test_bit(key_bits, KEY_ENTER)) {
-            udev_list_entry_add(&udev_device->properties, "ID_INPUT_KEYBOARD", "1", 0);
+            if (index != -1) {
+                *mask |= (uint64_t)1 << index;
+            }
         }
 
-        return;
+        tags += len + (tags[len] == ':');
     }
 }
 
-static void set_properties_from_props(struct udev_device *udev_device)
+static void set_properties_from_tags(struct udev_device *udev_device)
 {
-    const char *sysname, *subsystem;
-    struct udev_device *parent;
-    char id[256];
+    set_tags(udev_device, "TAGS", &udev_device->tags, &udev_device->tag_mask);
+    set_tags(udev_device, "CURRENT_TAGS", &udev_device->current_tags, &udev_device->current_tag_mask);
+}
 
-    subsystem = udev_device_get_subsystem(udev_device);
+// built-in providers, dispatched by subsystem. see udev_run_providers()
+static const struct {
+    const char *subsystem;
+    void (*fn)(struct udev_device *udev_device, void *data);
+} builtin_providers[] = {
+    { "input", set_properties_from_evdev },
+    { "block", udev_id_block },
+    { "usb", udev_id_usb },
+    { "input", udev_id_usb },
+    { "hidraw", udev_id_usb },
+    { "tty", udev_id_usb },
+    { "sound", udev_id_usb },
+    { "net", udev_id_usb },
+    { "video4linux", udev_id_usb },
+    { "usbmisc", udev_id_usb },
+    { "scsi_generic", udev_id_usb },
+    { NULL, udev_path_id },
+};
 
-    if (!subsystem || strcmp(subsystem, "drm") != 0) {
-        return;
+int udev_add_builtin_providers(struct udev *udev)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(builtin_providers) / sizeof(builtin_providers[0]); i++) {
+        if (udev_add_provider(udev, builtin_providers[i].subsystem, builtin_providers[i].fn, NULL, 1) == -1) {
+            return -1;
+        }
     }
 
-    parent = udev_device_get_parent_with_subsystem_devtype(udev_device, "pci", NULL);
-    sysname = udev_device_get_sysname(parent);
+    return 0;
+}
 
-    if (!sysname) {
-        return;
+int udev_device_add_property(struct udev_device *udev_device, const char *key, const char *value)
+{
+    if (!udev_device || !key) {
+        return -1;
     }
 
-    snprintf(id, sizeof(id), "pci-%s", sysname);
-    udev_list_entry_add(&udev_device->properties, "ID_PATH", id, 0);
+    return udev_list_entry_add(&udev_device->properties, key, value, 1) ? 0 : -1;
 }
 
-struct udev_device *udev_device_new_from_syspath(struct udev *udev, const char *syspath)
+// modules, buses, classes and drivers are not devices. their uevent can't be
+// read and they have no subsystem link, so the subsystem comes from the path
+static const char *get_path_subsystem(const char *syspath)
 {
-    char *subsystem, *driver, *sysname;
-    struct udev_device *udev_device;
-    char path[PATH_MAX];
-    int i;
+    const char *pos;
 
-    if (!udev || !syspath) {
-        return NULL;
+    if (strncmp(syspath, "/sys/module/", 12) == 0) {
+        return strchr(syspath + 12, '/') ? NULL : "module";
     }
 
-    if (!realpath(syspath, path)) {
+    if (strncmp(syspath, "/sys/class/", 11) == 0) {
+        return strchr(syspath + 11, '/') ? NULL : "subsystem";
+    }
+
+    if (strncmp(syspath, "/sys/bus/", 9) != 0) {
         return NULL;
     }
 
+    pos = strchr(syspath + 9, '/');
+
+    if (!pos) {
+        return "subsystem";
+    }
+
+    if (strncmp(pos, "/drivers/", 9) == 0 && !strchr(pos + 9, '/')) {
+        return "drivers";
+    }
+
+    return NULL;
+}
+
+static struct udev_device *new_device(struct udev *udev, const char *syspath, int resolved)
+{
+    char *subsystem, *driver, *sysname;
+    struct udev_device *udev_device;
+    const char *path_subsystem;
+    char path[PATH_MAX];
+    int i, fd;
+
     udev_device = calloc(1, sizeof(*udev_device));
 
     if (!udev_device) {
         return NULL;
     }
 
+    if (pthread_mutex_init(&udev_device->lock, NULL) != 0) {
+        free(udev_device);
+        return NULL;
+    }
+
     udev_device->udev = udev;
     udev_device->refcount = 1;
     udev_device->parent = NULL;
 
     udev_list_entry_init(&udev_device->properties);
     udev_list_entry_init(&udev_device->sysattrs);
+    udev_list_entry_init(&udev_device->sysattrs_old);
+    udev_list_entry_init(&udev_device->devlinks);
+    udev_list_entry_init(&udev_device->current_tags);
+    udev_list_entry_init(&udev_device->tags);
 
-    if (set_properties_from_uevent(udev_device, path) == -1) {
+    if (resolved) {
+        snprintf(path, sizeof(path), "%s", syspath);
+    }
+    else if (!realpath(syspath, path)) {
+        pthread_mutex_destroy(&udev_device->lock);
+        free(udev_device);
+        return NULL;
+    }
+
+    // lookups relative to the device directory don't walk the whole path
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    // devices stored in the database need neither sysfs nor built-in
+    // providers. the database may lag behind a removal, so the directory
+    // must still exist
+    if (fd != -1 && udev_db_get(udev, path, &udev_device->properties) == 0) {
+        close(fd);
+        set_properties_from_tags(udev_device);
+        udev_run_providers(udev, udev_device, 0);
+        return udev_device;
+    }
+
+    path_subsystem = get_path_subsystem(path);
+
+    if ((fd == -1 || set_properties_from_uevent(udev_device, fd) == -1) && !path_subsystem) {
+        if (fd != -1) {
+            close(fd);
+        }
+
+        pthread_mutex_destroy(&udev_device->lock);
         free(udev_device);
         return NULL;
     }
@@ -577,10 +1082,14 @@ struct udev_device *udev_device_new_from_syspath(struct udev *udev, const char *
     udev_list_entry_add(&udev_device->properties, "DEVPATH", path + 4, 0);
 
     sysname = strrchr(path, '/') + 1;
-    driver = read_symlink(path, "driver");
-    subsystem = read_symlink(path, "subsystem");
+    driver = read_symlink(fd, "driver");
+    subsystem = read_symlink(fd, "subsystem");
 
-    udev_list_entry_add(&udev_device->properties, "SUBSYSTEM", subsystem, 0);
+    if (fd != -1) {
+        close(fd);
+    }
+
+    udev_list_entry_add(&udev_device->properties, "SUBSYSTEM", subsystem ? subsystem : path_subsystem, 0);
     udev_list_entry_add(&udev_device->properties, "SYSNAME", sysname, 0);
     udev_list_entry_add(&udev_device->properties, "DRIVER", driver, 0);
 
@@ -591,14 +1100,34 @@ struct udev_device *udev_device_new_from_syspath(struct udev *udev, const char *
         }
     }
 
-    set_properties_from_evdev(udev_device);
-    set_properties_from_props(udev_device);
+    set_properties_from_tags(udev_device);
+    udev_run_providers(udev, udev_device, 1);
 
     free(driver);
     free(subsystem);
     return udev_device;
 }
 
+struct udev_device *udev_device_new_from_syspath(struct udev *udev, const char *syspath)
+{
+    if (!udev || !syspath) {
+        return NULL;
+    }
+
+    return new_device(udev, syspath, 0);
+}
+
+// syspath must already be canonical, which spares realpath() and its lstat
+// of every component
+struct udev_device *udev_device_new_from_resolved(struct udev *udev, const char *syspath)
+{
+    if (!udev || !syspath) {
+        return NULL;
+    }
+
+    return new_device(udev, syspath, 1);
+}
+
 struct udev_device *udev_device_new_from_devnum(struct udev *udev, char type, dev_t devnum)
 {
     char path[PATH_MAX];
@@ -650,18 +1179,31 @@ struct udev_device *udev_device_new_from_uevent(struct udev *udev, char *buf, si
     char *end, *pos;
     int i, cnt = 0;
 
+    if (!udev || !buf) {
+        return NULL;
+    }
+
     udev_device = calloc(1, sizeof(*udev_device));
 
     if (!udev_device) {
         return NULL;
     }
 
+    if (pthread_mutex_init(&udev_device->lock, NULL) != 0) {
+        free(udev_device);
+        return NULL;
+    }
+
     udev_device->udev = udev;
     udev_device->refcount = 1;
     udev_device->parent = NULL;
 
     udev_list_entry_init(&udev_device->properties);
     udev_list_entry_init(&udev_device->sysattrs);
+    udev_list_entry_init(&udev_device->sysattrs_old);
+    udev_list_entry_init(&udev_device->devlinks);
+    udev_list_entry_init(&udev_device->current_tags);
+    udev_list_entry_init(&udev_device->tags);
 
     for (end = buf + len; buf < end; buf += strlen(buf) + 1) {
        if (strncmp(buf, "DEVPATH=", 8) == 0) {
@@ -710,14 +1252,78 @@ struct udev_device *udev_device_new_from_uevent(struct udev *udev, char *buf, si
         return NULL;
     }
 
-    set_properties_from_props(udev_device);
-    set_properties_from_evdev(udev_device);
+    set_properties_from_tags(udev_device);
+    udev_run_providers(udev, udev_device, 1);
     return udev_device;
 }
 
-/* XXX NOT IMPLEMENTED */ struct udev_device *udev_device_new_from_device_id(struct udev *udev, const char *id)
+// b8:0, c13:64, n3, +usb:1-1, +drivers:usb:hub
+// every form maps directly to a sysfs path, nothing is scanned.
+struct udev_device *udev_device_new_from_device_id(struct udev *udev, const char *id)
 {
-    return NULL;
+    char path[PATH_MAX], subsystem[PATH_MAX], ifname[IF_NAMESIZE];
+    struct udev_device *udev_device;
+    unsigned int maj, min;
+    const char *sysname;
+    const char *ifindex;
+    char *end;
+    long num;
+
+    if (!udev || !id) {
+        return NULL;
+    }
+
+    switch (id[0]) {
+    case 'b':
+    case 'c':
+        if (sscanf(id + 1, "%u:%u", &maj, &min) != 2) {
+            return NULL;
+        }
+
+        return udev_device_new_from_devnum(udev, id[0], makedev(maj, min));
+    case 'n':
+        num = strtol(id + 1, &end, 10);
+
+        if (num <= 0 || *end != '\0' || !if_indextoname(num, ifname)) {
+            return NULL;
+        }
+
+        snprintf(path, sizeof(path), "/sys/class/net/%s", ifname);
+        udev_device = udev_device_new_from_syspath(udev, path);
+        ifindex = udev_device_get_property_value(udev_device, "IFINDEX");
+
+        // interface could have been renamed or replaced in the meantime
+        if (!ifindex || strcmp(ifindex, id + 1) != 0) {
+            udev_device_unref(udev_device);
+            return NULL;
+        }
+
+        return udev_device;
+    case '+':
+        sysname = strchr(id + 1, ':');
+
+        if (!sysname || sysname == id + 1 || sysname[1] == '\0') {
+            return NULL;
+        }
+
+        snprintf(subsystem, sizeof(subsystem), "%.*s", (int)(sysname - id - 1), id + 1);
+        sysname++;
+
+        if (strcmp(subsystem, "drivers") == 0) {
+            end = strchr(sysname, ':');
+
+            if (!end) {
+                return NULL;
+            }
+
+            snprintf(path, sizeof(path), "/sys/bus/%.*s/drivers/%s", (int)(end - sysname), sysname, end + 1);
+            return udev_device_new_from_syspath(udev, path);
+        }
+
+        return udev_device_new_from_subsystem_sysname(udev, subsystem, sysname);
+    default:
+        return NULL;
+    }
 }
 
 /* XXX NOT IMPLEMENTED */ struct udev_device *udev_device_new_from_environment(struct udev *udev)
@@ -731,7 +1337,7 @@ struct udev_device *udev_device_ref(struct udev_device *udev_device)
         return NULL;
     }
 
-    udev_device->refcount++;
+    __atomic_add_fetch(&udev_device->refcount, 1, __ATOMIC_RELAXED);
     return udev_device;
 }
 
@@ -741,7 +1347,7 @@ struct udev_device *udev_device_unref(struct udev_device *udev_device)
         return NULL;
     }
 
-    if (--udev_device->refcount > 0) {
+    if (__atomic_sub_fetch(&udev_device->refcount, 1, __ATOMIC_ACQ_REL) > 0) {
         return NULL;
     }
 
@@ -751,6 +1357,11 @@ struct udev_device *udev_device_unref(struct udev_device *udev_device)
 
     udev_list_entry_free_all(&udev_device->properties);
     udev_list_entry_free_all(&udev_device->sysattrs);
+    udev_list_entry_free_all(&udev_device->sysattrs_old);
+    udev_list_entry_free_all(&udev_device->devlinks);
+    udev_list_entry_free_all(&udev_device->current_tags);
+    udev_list_entry_free_all(&udev_device->tags);
+    pthread_mutex_destroy(&udev_device->lock);
 
     free(udev_device);
     return NULL;
@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2020-2021 illiliti <illiliti@protonmail.com>
+ * SPDX-License-Identifier: ISC
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "udev.h"
+#include "udev_list.h"
+#include "udev_hash.h"
+#include "udev_private.h"
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR)
+
+// reverse index of symlinks under /dev, keyed by device id, e.g. "b8:0".
+// it is built with a single walk of /dev and thrown away as soon as inotify
+// reports a change in any of the walked directories. directories which can't
+// be watched are revalidated by their mtime instead.
+
+static void free_links(void *ptr)
+{
+    struct udev_list_entry *list_entry = ptr;
+
+    udev_list_entry_free_all(list_entry);
+    free(list_entry);
+}
+
+static void add_link(struct udev *udev, const char *path)
+{
+    struct udev_list_entry *list_entry;
+    char link[PATH_MAX], id[64];
+    struct stat st;
+    ssize_t len;
+
+    len = readlink(path, link, sizeof(link) - 1);
+
+    if (len == -1) {
+        return;
+    }
+
+    link[len] = '\0';
+
+    // skip /dev/stdin, /dev/fd and friends
+    if (strncmp(link, "/proc/", 6) == 0) {
+        return;
+    }
+
+    if (stat(path, &st) == -1) {
+        return;
+    }
+
+    if (S_ISBLK(st.st_mode)) {
+        snprintf(id, sizeof(id), "b%u:%u", major(st.st_rdev), minor(st.st_rdev));
+    }
+    else if (S_ISCHR(st.st_mode)) {
+        snprintf(id, sizeof(id), "c%u:%u", major(st.st_rdev), minor(st.st_rdev));
+    }
+    else {
+        return;
+    }
+
+    list_entry = udev_hash_get(&udev->devlinks, id);
+
+    if (!list_entry) {
+        list_entry = calloc(1, sizeof(*list_entry));
+
+        if (!list_entry) {
+            return;
+        }
+
+        udev_list_entry_init(list_entry);
+
+        if (udev_hash_set(&udev->devlinks, id, list_entry) == -1) {
+            free(list_entry);
+            return;
+        }
+    }
+
+    udev_list_entry_add(list_entry, path, NULL, 0);
+}
+
+static void watch_dir(struct udev *udev, const char *path, int fd)
+{
+    char mtime[64];
+    struct stat st;
+
+    if (udev->devlinks_fd != -1 && inotify_add_watch(udev->devlinks_fd, path, WATCH_MASK) != -1) {
+        return;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        return;
+    }
+
+    // mtime can't tell apart changes made within the same clock tick, so a
+    // directory modified just now never validates and forces another walk
+    if (st.st_mtime >= time(NULL)) {
+        udev_list_entry_add(udev->devlinks_dirs, path, NULL, 0);
+        return;
+    }
+
+    snprintf(mtime, sizeof(mtime), "%lld.%ld", (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+    udev_list_entry_add(udev->devlinks_dirs, path, mtime, 0);
+}
+
+static void scan_dir(struct udev *udev, const char *path)
+{
+    char path2[PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+
+    dir = opendir(path);
+
+    if (!dir) {
+        return;
+    }
+
+    watch_dir(udev, path, dirfd(dir));
+
+    while ((de = readdir(dir))) {
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+
+        if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            continue;
+        }
+
+        snprintf(path2, sizeof(path2), "%s/%s", path, de->d_name);
+
+        if (S_ISLNK(st.st_mode)) {
+            add_link(udev, path2);
+        }
+        else if (S_ISDIR(st.st_mode)) {
+            // these never contain links to devices
+            if (strcmp(path, "/dev") == 0 &&
+                (strcmp(de->d_name, "pts") == 0 ||
+                 strcmp(de->d_name, "shm") == 0 ||
+                 strcmp(de->d_name, "mqueue") == 0 ||
+                 strcmp(de->d_name, "hugepages") == 0)) {
+                continue;
+            }
+
+            scan_dir(udev, path2);
+        }
+    }
+
+    closedir(dir);
+}
+
+static int is_valid(struct udev *udev)
+{
+    struct udev_list_entry *list_entry;
+    char buf[4096], mtime[64];
+    struct stat st;
+    int changed = 0;
+
+    if (!udev->devlinks_dirs) {
+        return 0;
+    }
+
+    while (udev->devlinks_fd != -1 && read(udev->devlinks_fd, buf, sizeof(buf)) > 0) {
+        changed = 1;
+    }
+
+    if (changed) {
+        return 0;
+    }
+
+    udev_list_entry_foreach(list_entry, udev_list_entry_get_next(udev->devlinks_dirs)) {
+        if (!udev_list_entry_get_value(list_entry) || stat(udev_list_entry_get_name(list_entry), &st) == -1) {
+            return 0;
+        }
+
+        snprintf(mtime, sizeof(mtime), "%lld.%ld", (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+
+        if (strcmp(udev_list_entry_get_value(list_entry), mtime) != 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void udev_devlinks_free(struct udev *udev)
+{
+    udev_hash_free(&udev->devlinks, free_links);
+
+    if (udev->devlinks_dirs) {
+        udev_list_entry_free_all(udev->devlinks_dirs);
+        free(udev->devlinks_dirs);
+        udev->devlinks_dirs = NULL;
+    }
+
+    if (udev->devlinks_fd != -1) {
+        close(udev->devlinks_fd);
+        udev->devlinks_fd = -1;
+    }
+}
+
+int udev_devlinks_get(struct udev *udev, const char *id, struct udev_list_entry *devlinks)
+{
+    struct udev_list_entry *list_entry;
+
+    pthread_mutex_lock(&udev->lock);
+
+    if (!is_valid(udev)) {
+        udev_devlinks_free(udev);
+        udev->devlinks_dirs = calloc(1, sizeof(*udev->devlinks_dirs));
+
+        if (!udev->devlinks_dirs) {
+            pthread_mutex_unlock(&udev->lock);
+            return -1;
+        }
+
+        udev_list_entry_init(udev->devlinks_dirs);
+        udev->devlinks_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        scan_dir(udev, "/dev");
+    }
+
+    udev_list_entry_foreach(list_entry, udev_list_entry_get_next(udev_hash_get(&udev->devlinks, id))) {
+        udev_list_entry_add(devlinks, udev_list_entry_get_name(list_entry), NULL, 0);
+    }
+
+    pthread_mutex_unlock(&udev->lock);
+    return 0;
+}
@@ -16,287 +16,1401 @@
  */
 
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <dirent.h>
 #include <string.h>
+#include <unistd.h>
 #include <limits.h>
 #include <fnmatch.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "udev.h"
 #include "udev_list.h"
+#include "udev_hash.h"
+#include "udev_private.h"
+
+// patterns are sorted by shape once they are added. literals go into a hash,
+// "foo*" and "*foo" are compared directly and only the rest is left to
+// fnmatch(), which is the same as calling fnmatch() for all of them
+#define PATTERN_LITERAL 0
+#define PATTERN_PREFIX 1
+#define PATTERN_SUFFIX 2
+#define PATTERN_GLOB 3
+
+struct pattern {
+    struct pattern *next;
+    size_t len;
+    int type;
+    char str[];
+};
+
+// set of patterns, matches if any of them does
+struct matcher {
+    struct udev_hash literals;
+    struct pattern *patterns;
+};
+
+// sysattr or property, paired with a pattern for the value
+struct match {
+    struct match *next;
+    struct pattern *name;
+    struct pattern *value;
+};
+
+// checks of a built device: tags, properties, sysattr match and nomatch
+#define FILTER_MAX 4
 
 struct udev_enumerate {
-    struct udev_list_entry subsystem_nomatch;
+    int (*filters[FILTER_MAX + 1])(struct udev_enumerate *udev_enumerate, struct udev_device *udev_device);
     struct udev_list_entry subsystem_match;
-    struct udev_list_entry sysattr_nomatch;
-    struct udev_list_entry property_match;
-    struct udev_list_entry sysattr_match;
-    struct udev_list_entry sysname_match;
+    struct udev_list_entry tag_match;
+    struct udev_list_entry added;
     struct udev_list_entry devices;
+    struct udev_list_entry *devices_tail;
+    struct matcher subsystems;
+    struct matcher nosubsystems;
+    struct matcher sysnames;
+    struct match *properties;
+    struct match *sysattrs;
+    struct match *nosysattrs;
+    struct udev_hash results;
+    struct udev_hash built;
+    struct udev_device *parent;
+    struct udev_monitor *monitor;
     struct udev *udev;
+    void (*live_fn)(struct udev_enumerate *udev_enumerate, struct udev_device *udev_device, void *data);
+    void *live_data;
+    int (*scan_fn)(struct udev_device *udev_device, void *data);
+    void *scan_data;
+    int stop;
+    unsigned long generation;
+    uint64_t tag_mask;
+    int tag_fallback;
+    int threads;
     int refcount;
 };
 
+// workers take entries in chunks to keep the lock out of the hot path
+#define SCAN_CHUNK 16
+
+struct scan {
+    struct udev_enumerate *udev_enumerate;
+    struct udev_device **devices;
+    char **syspaths;
+    size_t cnt, len, next;
+    pthread_mutex_t lock;
+};
+
+static void plan_filters(struct udev_enumerate *udev_enumerate);
+
+static struct pattern *compile_pattern(const char *str)
+{
+    struct pattern *pattern;
+    const char *pos;
+    size_t len;
+
+    len = strlen(str);
+    pattern = calloc(1, sizeof(*pattern) + len + 1);
+
+    if (!pattern) {
+        return NULL;
+    }
+
+    pos = strpbrk(str, "*?[\\");
+
+    if (!pos) {
+        pattern->type = PATTERN_LITERAL;
+    }
+    else if (*pos == '*' && pos == str + len - 1) {
+        pattern->type = PATTERN_PREFIX;
+        len--;
+    }
+    else if (*pos == '*' && pos == str && !strpbrk(str + 1, "*?[\\")) {
+        pattern->type = PATTERN_SUFFIX;
+        str++;
+        len--;
+    }
+    else {
+        pattern->type = PATTERN_GLOB;
+    }
+
+    memcpy(pattern->str, str, len);
+    pattern->len = len;
+    return pattern;
+}
+
+static int match_pattern(const struct pattern *pattern, const char *str)
+{
+    size_t len;
+
+    if (pattern->type == PATTERN_LITERAL) {
+        return strcmp(pattern->str, str) == 0;
+    }
+
+    if (pattern->type == PATTERN_PREFIX) {
+        return strncmp(pattern->str, str, pattern->len) == 0;
+    }
+
+    if (pattern->type == PATTERN_SUFFIX) {
+        len = strlen(str);
+        return len >= pattern->len && memcmp(str + len - pattern->len, pattern->str, pattern->len) == 0;
+    }
+
+    return fnmatch(pattern->str, str, 0) == 0;
+}
+
+static void free_patterns(struct pattern *pattern)
+{
+    struct pattern *next;
+
+    for (; pattern; pattern = next) {
+        next = pattern->next;
+        free(pattern);
+    }
+}
+
+static int add_matcher(struct matcher *matcher, const char *str)
+{
+    struct pattern *pattern;
+
+    pattern = compile_pattern(str);
+
+    if (!pattern) {
+        return -1;
+    }
+
+    if (pattern->type == PATTERN_LITERAL) {
+        free(pattern);
+
+        // only presence matters, any non-NULL value will do
+        return udev_hash_set(&matcher->literals, str, matcher);
+    }
+
+    pattern->next = matcher->patterns;
+    matcher->patterns = pattern;
+    return 0;
+}
+
+static int is_matcher_empty(const struct matcher *matcher)
+{
+    return !matcher->literals.count && !matcher->patterns;
+}
+
+static int match_matcher(struct matcher *matcher, const char *str)
+{
+    struct pattern *pattern;
+
+    if (matcher->literals.count && udev_hash_get(&matcher->literals, str)) {
+        return 1;
+    }
+
+    for (pattern = matcher->patterns; pattern; pattern = pattern->next) {
+        if (match_pattern(pattern, str)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void free_matcher(struct matcher *matcher)
+{
+    udev_hash_free(&matcher->literals, NULL);
+    free_patterns(matcher->patterns);
+    matcher->patterns = NULL;
+}
+
+static int add_match(struct match **list, const char *name, const char *value)
+{
+    struct match *match;
+
+    match = calloc(1, sizeof(*match));
+
+    if (!match) {
+        return -1;
+    }
+
+    match->name = compile_pattern(name);
+
+    // without value nothing is matched, same as before compiling
+    if (value) {
+        match->value = compile_pattern(value);
+    }
+
+    if (!match->name || (value && !match->value)) {
+        free(match->name);
+        free(match->value);
+        free(match);
+        return -1;
+    }
+
+    match->next = *list;
+    *list = match;
+    return 0;
+}
+
+static void free_matches(struct match *match)
+{
+    struct match *next;
+
+    for (; match; match = next) {
+        next = match->next;
+        free(match->name);
+        free(match->value);
+        free(match);
+    }
+}
+
 int udev_enumerate_add_match_subsystem(struct udev_enumerate *udev_enumerate, const char *subsystem)
 {
-    return udev_enumerate ? !!udev_list_entry_add(&udev_enumerate->subsystem_match, subsystem, NULL, 0) - 1 : -1;
+    if (!udev_enumerate || !subsystem) {
+        return -1;
+    }
+
+    if (!udev_list_entry_add(&udev_enumerate->subsystem_match, subsystem, NULL, 0)) {
+        return -1;
+    }
+
+    return add_matcher(&udev_enumerate->subsystems, subsystem);
+}
+
+int udev_enumerate_add_nomatch_subsystem(struct udev_enumerate *udev_enumerate, const char *subsystem)
+{
+    return udev_enumerate && subsystem ? add_matcher(&udev_enumerate->nosubsystems, subsystem) : -1;
+}
+
+int udev_enumerate_add_match_sysattr(struct udev_enumerate *udev_enumerate, const char *sysattr, const char *value)
+{
+    if (!udev_enumerate || !sysattr || add_match(&udev_enumerate->sysattrs, sysattr, value) == -1) {
+        return -1;
+    }
+
+    plan_filters(udev_enumerate);
+    return 0;
+}
+
+int udev_enumerate_add_nomatch_sysattr(struct udev_enumerate *udev_enumerate, const char *sysattr, const char *value)
+{
+    if (!udev_enumerate || !sysattr || add_match(&udev_enumerate->nosysattrs, sysattr, value) == -1) {
+        return -1;
+    }
+
+    plan_filters(udev_enumerate);
+    return 0;
+}
+
+int udev_enumerate_add_match_property(struct udev_enumerate *udev_enumerate, const char *property, const char *value)
+{
+    if (!udev_enumerate || !property || add_match(&udev_enumerate->properties, property, value) == -1) {
+        return -1;
+    }
+
+    plan_filters(udev_enumerate);
+    return 0;
+}
+
+int udev_enumerate_add_match_sysname(struct udev_enumerate *udev_enumerate, const char *sysname)
+{
+    return udev_enumerate && sysname ? add_matcher(&udev_enumerate->sysnames, sysname) : -1;
+}
+
+int udev_enumerate_add_match_tag(struct udev_enumerate *udev_enumerate, const char *tag)
+{
+    int index;
+
+    if (!udev_enumerate || !tag) {
+        return -1;
+    }
+
+    if (!udev_list_entry_add(&udev_enumerate->tag_match, tag, NULL, 0)) {
+        return -1;
+    }
+
+    index = udev_tag_index(udev_enumerate->udev, tag, 1);
+
+    if (index == -1) {
+        udev_enumerate->tag_fallback = 1;
+    }
+    else {
+        udev_enumerate->tag_mask |= (uint64_t)1 << index;
+    }
+
+    plan_filters(udev_enumerate);
+    return 0;
+}
+
+// like systemd, only the last parent counts
+int udev_enumerate_add_match_parent(struct udev_enumerate *udev_enumerate, struct udev_device *parent)
+{
+    if (!udev_enumerate || !parent) {
+        return -1;
+    }
+
+    udev_device_unref(udev_enumerate->parent);
+    udev_enumerate->parent = udev_device_ref(parent);
+    return 0;
+}
+
+/* XXX NOT IMPLEMENTED */ int udev_enumerate_add_match_is_initialized(struct udev_enumerate *udev_enumerate)
+{
+    return 0;
+}
+
+static int filter_subsystem(struct udev_enumerate *udev_enumerate, const char *subsystem)
+{
+    if (!subsystem) {
+        return 0;
+    }
+
+    if (match_matcher(&udev_enumerate->nosubsystems, subsystem)) {
+        return 0;
+    }
+
+    return is_matcher_empty(&udev_enumerate->subsystems) || match_matcher(&udev_enumerate->subsystems, subsystem);
+}
+
+static int filter_sysname(struct udev_enumerate *udev_enumerate, const char *sysname)
+{
+    return is_matcher_empty(&udev_enumerate->sysnames) || match_matcher(&udev_enumerate->sysnames, sysname);
+}
+
+static int filter_property(struct udev_enumerate *udev_enumerate, struct udev_device *udev_device)
+{
+    struct udev_list_entry *list_entry;
+    struct match *match;
+    const char *value;
+
+    if (!udev_enumerate->properties) {
+        return 1;
+    }
+
+    for (match = udev_enumerate->properties; match; match = match->next) {
+        if (!match->value) {
+            continue;
+        }
+
+        // literal names are looked up instead of walking all properties
+        if (match->name->type == PATTERN_LITERAL) {
+            value = udev_device_get_property_value(udev_device, match->name->str);
+
+            if (value && match_pattern(match->value, value)) {
+                return 1;
+            }
+
+            continue;
+        }
+
+        udev_list_entry_foreach(list_entry, udev_device_get_properties_list_entry(udev_device)) {
+            value = udev_list_entry_get_value(list_entry);
+
+            if (value && match_pattern(match->name, udev_list_entry_get_name(list_entry)) &&
+                match_pattern(match->value, value)) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// nothing is matched without a value, so such entries are never read
+static int filter_sysattr(struct udev_enumerate *udev_enumerate, struct udev_device *udev_device)
+{
+    struct match *match;
+    const char *value;
+
+    for (match = udev_enumerate->sysattrs; match; match = match->next) {
+        if (!match->value) {
+            continue;
+        }
+
+        value = udev_device_get_sysattr_value(udev_device, match->name->str);
+
+        if (value && match_pattern(match->value, value)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int filter_nosysattr(struct udev_enumerate *udev_enumerate, struct udev_device *udev_device)
+{
+    struct match *match;
+    const char *value;
+
+    for (match = udev_enumerate->nosysattrs; match; match = match->next) {
+        if (!match->value) {
+            continue;
+        }
+
+        value = udev_device_get_sysattr_value(udev_device, match->name->str);
+
+        if (value && match_pattern(match->value, value)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int filter_tag(struct udev_enumerate *udev_enumerate, struct udev_device *udev_device)
+{
+    struct udev_list_entry *list_entry;
+
+    if ((udev_device_get_tag_mask(udev_device) & udev_enumerate->tag_mask) != udev_enumerate->tag_mask) {
+        return 0;
+    }
+
+    if (!udev_enumerate->tag_fallback) {
+        return 1;
+    }
+
+    udev_list_entry_foreach(list_entry, udev_list_entry_get_next(&udev_enumerate->tag_match)) {
+        if (!udev_device_has_tag(udev_device, udev_list_entry_get_name(list_entry))) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// orders checks of a built device by cost: the tag mask is a single AND,
+// properties are in memory and sysattrs are read from sysfs. sysattr match
+// goes before nomatch, because it usually rejects after fewer reads. checks
+// which can't reject anything are left out
+static void plan_filters(struct udev_enumerate *udev_enumerate)
+{
+    struct match *match;
+    int i = 0;
+
+    if (udev_list_entry_get_next(&udev_enumerate->tag_match)) {
+        udev_enumerate->filters[i++] = filter_tag;
+    }
+
+    if (udev_enumerate->properties) {
+        udev_enumerate->filters[i++] = filter_property;
+    }
+
+    if (udev_enumerate->sysattrs) {
+        udev_enumerate->filters[i++] = filter_sysattr;
+    }
+
+    for (match = udev_enumerate->nosysattrs; match; match = match->next) {
+        if (match->value) {
+            udev_enumerate->filters[i++] = filter_nosysattr;
+            break;
+        }
+    }
+
+    udev_enumerate->filters[i] = NULL;
+}
+
+static int match_device(struct udev_enumerate *udev_enumerate, struct udev_device *udev_device, int pushdown)
+{
+    int i;
+
+    if (!pushdown && !filter_subsystem(udev_enumerate, udev_device_get_subsystem(udev_device))) {
+        return 0;
+    }
+
+    for (i = 0; udev_enumerate->filters[i]; i++) {
+        if (!udev_enumerate->filters[i](udev_enumerate, udev_device)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// syspaths are canonical, so the sysname is checked before the device is
+// built. scans only visit directories of matching subsystems, which leaves
+// the subsystem to be checked only by callers without pushdown
+static struct udev_device *new_device(struct udev_enumerate *udev_enumerate, const char *syspath, int pushdown)
+{
+    struct udev_device *udev_device;
+
+    if (!filter_sysname(udev_enumerate, strrchr(syspath, '/') + 1)) {
+        return NULL;
+    }
+
+    udev_device = udev_device_new_from_resolved(udev_enumerate->udev, syspath);
+
+    if (!udev_device) {
+        return NULL;
+    }
+
+    if (!match_device(udev_enumerate, udev_device, pushdown)) {
+        udev_device_unref(udev_device);
+        return NULL;
+    }
+
+    return udev_device;
+}
+
+static void free_device(void *ptr)
+{
+    udev_device_unref(ptr);
+}
+
+// results keep the order they were added in and are indexed by syspath,
+// so that a duplicate costs a lookup instead of a walk of the list
+static int add_result(struct udev_enumerate *udev_enumerate, const char *syspath)
+{
+    struct udev_list_entry *list_entry;
+
+    if (udev_hash_get(&udev_enumerate->results, syspath)) {
+        return 0;
+    }
+
+    list_entry = udev_list_entry_add(udev_enumerate->devices_tail, syspath, NULL, 0);
+
+    if (!list_entry) {
+        return -1;
+    }
+
+    if (udev_hash_set(&udev_enumerate->results, syspath, list_entry) == -1) {
+        udev_enumerate->devices_tail->next = NULL;
+        udev_list_entry_free(list_entry);
+        return -1;
+    }
+
+    udev_enumerate->devices_tail = list_entry;
+    return 0;
+}
+
+static int remove_result(struct udev_enumerate *udev_enumerate, const char *syspath)
+{
+    struct udev_list_entry *list_entry, *list_entry2;
+
+    list_entry2 = udev_hash_remove(&udev_enumerate->results, syspath);
+
+    if (!list_entry2) {
+        return 0;
+    }
+
+    list_entry = &udev_enumerate->devices;
+
+    while (list_entry->next != list_entry2) {
+        list_entry = list_entry->next;
+    }
+
+    list_entry->next = list_entry2->next;
+
+    if (udev_enumerate->devices_tail == list_entry2) {
+        udev_enumerate->devices_tail = list_entry;
+    }
+
+    udev_list_entry_free(list_entry2);
+    udev_device_unref(udev_hash_remove(&udev_enumerate->built, syspath));
+    return 1;
+}
+
+static void free_results(struct udev_enumerate *udev_enumerate)
+{
+    udev_list_entry_free_all(&udev_enumerate->devices);
+    udev_list_entry_init(&udev_enumerate->devices);
+    udev_enumerate->devices_tail = &udev_enumerate->devices;
+    udev_hash_free(&udev_enumerate->results, NULL);
+    udev_hash_free(&udev_enumerate->built, free_device);
+}
+
+// devices which passed the filters are kept for udev_enumerate_get_device()
+// to not build them again. takes over the reference
+static int store_device(struct udev_enumerate *udev_enumerate, struct udev_device *udev_device)
+{
+    const char *syspath;
+
+    syspath = udev_device_get_syspath(udev_device);
+
+    if (add_result(udev_enumerate, syspath) == -1) {
+        udev_device_unref(udev_device);
+        return -1;
+    }
+
+    udev_device_unref(udev_hash_remove(&udev_enumerate->built, syspath));
+
+    if (udev_hash_set(&udev_enumerate->built, syspath, udev_device) == -1) {
+        udev_device_unref(udev_device);
+    }
+
+    return 0;
+}
+
+static void add_device(struct udev_enumerate *udev_enumerate, const char *syspath, int pushdown)
+{
+    struct udev_device *udev_device;
+
+    udev_device = new_device(udev_enumerate, syspath, pushdown);
+
+    if (!udev_device) {
+        return;
+    }
+
+    // streamed devices are not kept
+    if (udev_enumerate->scan_fn) {
+        if (udev_enumerate->scan_fn(udev_device, udev_enumerate->scan_data) != 0) {
+            udev_enumerate->stop = 1;
+        }
+
+        udev_device_unref(udev_device);
+        return;
+    }
+
+    store_device(udev_enumerate, udev_device);
+}
+
+// turn directory entry into canonical syspath without realpath(). link
+// targets in sysfs are relative and have no links in between, so dropping
+// one component per ".." gives the same result
+static int resolve_entry(const char *path, int fd, const char *name, char *buf, size_t len)
+{
+    char link[PATH_MAX], *pos;
+    const char *target;
+    ssize_t cnt;
+
+    cnt = readlinkat(fd, name, link, sizeof(link) - 1);
+
+    if (cnt == -1) {
+        return snprintf(buf, len, "%s/%s", path, name) < (int)len ? 0 : -1;
+    }
+
+    link[cnt] = '\0';
+
+    if (link[0] == '/') {
+        return snprintf(buf, len, "%s", link) < (int)len ? 0 : -1;
+    }
+
+    snprintf(buf, len, "%s", path);
+
+    for (target = link; strncmp(target, "../", 3) == 0; target += 3) {
+        pos = strrchr(buf, '/');
+
+        if (!pos || pos == buf) {
+            return -1;
+        }
+
+        *pos = '\0';
+    }
+
+    cnt = strlen(buf);
+    return snprintf(buf + cnt, len - cnt, "/%s", target) < (int)(len - cnt) ? 0 : -1;
+}
+
+static int is_literal(struct udev_list_entry *list_entry)
+{
+    if (!list_entry) {
+        return 0;
+    }
+
+    for (; list_entry; list_entry = udev_list_entry_get_next(list_entry)) {
+        if (strpbrk(udev_list_entry_get_name(list_entry), "*?[\\")) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int scan_subsystem(struct udev_enumerate *udev_enumerate, const char *subsystem,
+        int (*fn)(struct udev_enumerate *udev_enumerate, const char *path, void *data), void *data)
+{
+    char path[PATH_MAX];
+
+    if (!filter_subsystem(udev_enumerate, subsystem)) {
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "/sys/bus/%s/devices", subsystem);
+
+    if (fn(udev_enumerate, path, data) == -1) {
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "/sys/class/%s", subsystem);
+    return fn(udev_enumerate, path, data);
+}
+
+// inventory of /sys/bus and /sys/class kept on struct udev, with entries
+// named by directory and valued by subsystem. sysfs keeps the link count of
+// a directory at the number of its subdirectories plus two, so a subsystem
+// coming or going is noticed with stat() instead of listing both again
+static const char *subsystem_dirs[] = { "/sys/bus", "/sys/class" };
+
+void udev_subsystems_free(struct udev *udev)
+{
+    if (udev->subsystems) {
+        udev_list_entry_free_all(udev->subsystems);
+        free(udev->subsystems);
+        udev->subsystems = NULL;
+    }
+}
+
+static int list_subsystems(struct udev *udev, const nlink_t *nlink)
+{
+    struct udev_list_entry *list_entry;
+    char path[PATH_MAX];
+    struct dirent *de;
+    int i, cnt = 0;
+    DIR *dir;
+
+    udev->subsystems = calloc(1, sizeof(*udev->subsystems));
+
+    if (!udev->subsystems) {
+        return -1;
+    }
+
+    udev_list_entry_init(udev->subsystems);
+    list_entry = udev->subsystems;
+
+    for (i = 0; i < 2; i++) {
+        dir = opendir(subsystem_dirs[i]);
+
+        if (!dir) {
+            continue;
+        }
+
+        cnt++;
+
+        while ((de = readdir(dir))) {
+            if (de->d_name[0] == '.') {
+                continue;
+            }
+
+            snprintf(path, sizeof(path), "%s/%s", subsystem_dirs[i], de->d_name);
+
+            // adding after the last entry keeps the order of readdir()
+            list_entry = udev_list_entry_add(list_entry, path, de->d_name, 0);
+
+            if (!list_entry) {
+                closedir(dir);
+                udev_subsystems_free(udev);
+                return -1;
+            }
+        }
+
+        closedir(dir);
+    }
+
+    if (!cnt) {
+        udev_subsystems_free(udev);
+        return -1;
+    }
+
+    udev->subsystems_nlink[0] = nlink[0];
+    udev->subsystems_nlink[1] = nlink[1];
+    return 0;
 }
 
-int udev_enumerate_add_nomatch_subsystem(struct udev_enumerate *udev_enumerate, const char *subsystem)
-{
-    return udev_enumerate ? !!udev_list_entry_add(&udev_enumerate->subsystem_nomatch, subsystem, NULL, 0) - 1 : -1;
+int udev_subsystems_get(struct udev *udev, struct udev_list_entry *subsystems)
+{
+    struct udev_list_entry *list_entry;
+    nlink_t nlink[2];
+    struct stat st;
+    int i, ret = 0;
+
+    // taken before listing, so that changes in between trigger another one
+    for (i = 0; i < 2; i++) {
+        nlink[i] = stat(subsystem_dirs[i], &st) == 0 ? st.st_nlink : 0;
+    }
+
+    pthread_mutex_lock(&udev->lock);
+
+    if (!udev->subsystems || udev->subsystems_nlink[0] != nlink[0] || udev->subsystems_nlink[1] != nlink[1]) {
+        udev_subsystems_free(udev);
+        ret = list_subsystems(udev, nlink);
+    }
+
+    if (ret == 0) {
+        udev_list_entry_foreach(list_entry, udev_list_entry_get_next(udev->subsystems)) {
+            subsystems = udev_list_entry_add(subsystems, udev_list_entry_get_name(list_entry),
+                                             udev_list_entry_get_value(list_entry), 0);
+
+            if (!subsystems) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&udev->lock);
+    return ret;
 }
 
-int udev_enumerate_add_match_sysattr(struct udev_enumerate *udev_enumerate, const char *sysattr, const char *value)
+// devices live in /sys/bus/X/devices or /sys/class/X, where X is their
+// subsystem. whole directories are skipped by subsystem filters and
+// literal matches don't even need the inventory
+static int scan_subsystems(struct udev_enumerate *udev_enumerate,
+        int (*fn)(struct udev_enumerate *udev_enumerate, const char *path, void *data), void *data)
 {
-    return udev_enumerate ? !!udev_list_entry_add(&udev_enumerate->sysattr_match, sysattr, value, 0) - 1 : -1;
-}
+    struct udev_list_entry subsystems, *list_entry;
+    const char *name;
+    char buf[PATH_MAX];
+    int ret = 0;
 
-int udev_enumerate_add_nomatch_sysattr(struct udev_enumerate *udev_enumerate, const char *sysattr, const char *value)
-{
-    return udev_enumerate ? !!udev_list_entry_add(&udev_enumerate->sysattr_nomatch, sysattr, value, 0) - 1 : -1;
-}
+    list_entry = udev_list_entry_get_next(&udev_enumerate->subsystem_match);
 
-int udev_enumerate_add_match_property(struct udev_enumerate *udev_enumerate, const char *property, const char *value)
-{
-    return udev_enumerate ? !!udev_list_entry_add(&udev_enumerate->property_match, property, value, 0) - 1 : -1;
-}
+    if (is_literal(list_entry)) {
+        for (; list_entry && !udev_enumerate->stop; list_entry = udev_list_entry_get_next(list_entry)) {
+            // the same subsystem may be added twice
+            if (udev_list_entry_get_by_name(udev_list_entry_get_next(list_entry), udev_list_entry_get_name(list_entry))) {
+                continue;
+            }
 
-int udev_enumerate_add_match_sysname(struct udev_enumerate *udev_enumerate, const char *sysname)
-{
-    return udev_enumerate ? !!udev_list_entry_add(&udev_enumerate->sysname_match, sysname, NULL, 0) - 1 : -1;
-}
+            if (scan_subsystem(udev_enumerate, udev_list_entry_get_name(list_entry), fn, data) == -1) {
+                return -1;
+            }
+        }
 
-/* XXX NOT IMPLEMENTED */ int udev_enumerate_add_match_tag(struct udev_enumerate *udev_enumerate, const char *tag)
-{
-    return 0;
+        return 0;
+    }
+
+    udev_list_entry_init(&subsystems);
+
+    if (udev_subsystems_get(udev_enumerate->udev, &subsystems) == -1) {
+        udev_list_entry_free_all(&subsystems);
+        return -1;
+    }
+
+    udev_list_entry_foreach(list_entry, udev_list_entry_get_next(&subsystems)) {
+        if (udev_enumerate->stop) {
+            break;
+        }
+
+        if (!filter_subsystem(udev_enumerate, udev_list_entry_get_value(list_entry))) {
+            continue;
+        }
+
+        name = udev_list_entry_get_name(list_entry);
+
+        if (strncmp(name, "/sys/bus/", 9) == 0) {
+            snprintf(buf, sizeof(buf), "%s/devices", name);
+            name = buf;
+        }
+
+        if (fn(udev_enumerate, name, data) == -1) {
+            ret = -1;
+            break;
+        }
+    }
+
+    udev_list_entry_free_all(&subsystems);
+    return ret;
 }
 
-/* XXX NOT IMPLEMENTED */ int udev_enumerate_add_match_parent(struct udev_enumerate *udev_enumerate, struct udev_device *parent)
+// readdir() reuses one buffer for all entries and lookups are relative to
+// the directory, so rejected entries cost no allocation at all
+static int scan_devices(struct udev_enumerate *udev_enumerate, const char *path, void *data)
 {
+    char syspath[PATH_MAX];
+    struct dirent *de;
+    DIR *dir;
+
+    dir = opendir(path);
+
+    if (!dir) {
+        return 0;
+    }
+
+    while (!udev_enumerate->stop && (de = readdir(dir))) {
+        if (de->d_name[0] == '.' || resolve_entry(path, dirfd(dir), de->d_name, syspath, sizeof(syspath)) == -1) {
+            continue;
+        }
+
+        add_device(udev_enumerate, syspath, 1);
+    }
+
+    closedir(dir);
     return 0;
 }
 
-/* XXX NOT IMPLEMENTED */ int udev_enumerate_add_match_is_initialized(struct udev_enumerate *udev_enumerate)
+static void *scan_worker(void *ptr)
 {
-    return 0;
+    struct scan *scan = ptr;
+    size_t i, end;
+
+    while (1) {
+        pthread_mutex_lock(&scan->lock);
+        i = scan->next;
+        scan->next += SCAN_CHUNK;
+        pthread_mutex_unlock(&scan->lock);
+
+        if (i >= scan->cnt) {
+            break;
+        }
+
+        end = i + SCAN_CHUNK < scan->cnt ? i + SCAN_CHUNK : scan->cnt;
+
+        for (; i < end; i++) {
+            scan->devices[i] = new_device(scan->udev_enumerate, scan->syspaths[i], 1);
+        }
+    }
+
+    return NULL;
 }
 
-static int filter_subsystem(struct udev_enumerate *udev_enumerate, struct udev_device *udev_device)
+static int collect_entries(struct udev_enumerate *udev_enumerate, const char *path, void *data)
 {
-    struct udev_list_entry *list_entry;
-    const char *subsystem;
+    struct scan *scan = data;
+    char syspath[PATH_MAX];
+    struct dirent *de;
+    char **syspaths;
+    int ret = 0;
+    DIR *dir;
 
-    subsystem = udev_device_get_subsystem(udev_device);
-    list_entry = udev_list_entry_get_next(&udev_enumerate->subsystem_nomatch);
+    dir = opendir(path);
 
-    if (!subsystem) {
+    if (!dir) {
         return 0;
     }
 
-    while (list_entry) {
-        if (fnmatch(udev_list_entry_get_name(list_entry), subsystem, 0) == 0) {
-            return 0;
+    while ((de = readdir(dir))) {
+        if (de->d_name[0] == '.' || resolve_entry(path, dirfd(dir), de->d_name, syspath, sizeof(syspath)) == -1) {
+            continue;
         }
 
-        list_entry = udev_list_entry_get_next(list_entry);
-    }
-
-    list_entry = udev_list_entry_get_next(&udev_enumerate->subsystem_match);
+        if (scan->cnt == scan->len) {
+            syspaths = realloc(scan->syspaths, (scan->len * 2 + 256) * sizeof(*syspaths));
 
-    if (list_entry) {
-        while (list_entry) {
-            if (fnmatch(udev_list_entry_get_name(list_entry), subsystem, 0) == 0) {
-                return 1;
+            if (!syspaths) {
+                ret = -1;
+                break;
             }
 
-            list_entry = udev_list_entry_get_next(list_entry);
+            scan->syspaths = syspaths;
+            scan->len = scan->len * 2 + 256;
         }
 
-        return 0;
+        scan->syspaths[scan->cnt] = strdup(syspath);
+
+        if (!scan->syspaths[scan->cnt]) {
+            ret = -1;
+            break;
+        }
+
+        scan->cnt++;
     }
 
-    return 1;
+    closedir(dir);
+    return ret;
 }
 
-static int filter_sysname(struct udev_enumerate *udev_enumerate, struct udev_device *udev_device)
+// devices are built and filtered by a pool of workers. the calling thread
+// takes part as well and results are merged in the order of a serial scan
+static int scan_devices_parallel(struct udev_enumerate *udev_enumerate)
 {
-    struct udev_list_entry *list_entry;
-    const char *sysname;
+    struct scan scan = {0};
+    pthread_t *threads;
+    int i, ret = -1, cnt = 0;
+    size_t j;
 
-    sysname = udev_device_get_sysname(udev_device);
-    list_entry = udev_list_entry_get_next(&udev_enumerate->sysname_match);
+    scan.udev_enumerate = udev_enumerate;
 
-    if (!list_entry) {
-        return 1;
+    if (scan_subsystems(udev_enumerate, collect_entries, &scan) == -1) {
+        goto out;
     }
 
-    while (list_entry) {
-        if (fnmatch(udev_list_entry_get_name(list_entry), sysname, 0) == 0) {
-            return 1;
+    scan.devices = calloc(scan.cnt, sizeof(*scan.devices));
+    threads = calloc(udev_enumerate->threads - 1, sizeof(*threads));
+
+    if ((scan.cnt && !scan.devices) || !threads || pthread_mutex_init(&scan.lock, NULL) != 0) {
+        free(threads);
+        goto out;
+    }
+
+    for (i = 0; i < udev_enumerate->threads - 1 && (size_t)i * SCAN_CHUNK < scan.cnt; i++) {
+        if (pthread_create(&threads[cnt], NULL, scan_worker, &scan) == 0) {
+            cnt++;
         }
+    }
+
+    scan_worker(&scan);
 
-        list_entry = udev_list_entry_get_next(list_entry);
+    for (i = 0; i < cnt; i++) {
+        pthread_join(threads[i], NULL);
     }
 
-    return 0;
+    free(threads);
+    pthread_mutex_destroy(&scan.lock);
+
+    for (j = 0; j < scan.cnt; j++) {
+        if (scan.devices[j]) {
+            store_device(udev_enumerate, scan.devices[j]);
+        }
+    }
+
+    ret = 0;
+
+out:
+    for (j = 0; j < scan.cnt; j++) {
+        free(scan.syspaths[j]);
+    }
+
+    free(scan.syspaths);
+    free(scan.devices);
+    return ret;
 }
 
-static int filter_property(struct udev_enumerate *udev_enumerate, struct udev_device *udev_device)
+static int filter_parent(struct udev_enumerate *udev_enumerate, const char *syspath)
 {
-    const char *property, *property2, *value, *value2;
-    struct udev_list_entry *list_entry, *list_entry2;
-
-    list_entry = udev_list_entry_get_next(&udev_enumerate->property_match);
+    const char *parent;
+    size_t len;
 
-    if (!list_entry) {
+    if (!udev_enumerate->parent) {
         return 1;
     }
 
-    while (list_entry) {
-        property = udev_list_entry_get_name(list_entry);
-        value = udev_list_entry_get_value(list_entry);
+    parent = udev_device_get_syspath(udev_enumerate->parent);
+    len = strlen(parent);
+
+    return strncmp(syspath, parent, len) == 0 && (syspath[len] == '/' || syspath[len] == '\0');
+}
 
-        list_entry2 = udev_device_get_properties_list_entry(udev_device);
+// depth-first walk of the subtree. device directories are the ones with
+// uevent file, links are not followed to stay inside the subtree
+static void scan_subtree(struct udev_enumerate *udev_enumerate, int fd, char *path, size_t len)
+{
+    struct dirent *de;
+    size_t len2;
+    DIR *dir;
+    int fd2;
 
-        if (!list_entry2) {
-            return 0;
+    if (faccessat(fd, "uevent", F_OK, 0) == 0) {
+        add_device(udev_enumerate, path, 0);
+    }
+
+    dir = fdopendir(fd);
+
+    if (!dir) {
+        close(fd);
+        return;
+    }
+
+    while (!udev_enumerate->stop && (de = readdir(dir))) {
+        if (de->d_name[0] == '.') {
+            continue;
         }
 
-        while (list_entry2) {
-            property2 = udev_list_entry_get_name(list_entry2);
-            value2 = udev_list_entry_get_value(list_entry2);
+        len2 = len + 1 + strlen(de->d_name);
 
-            if (value && value2) {
-                if (fnmatch(property, property2, 0) == 0 &&
-                    fnmatch(value, value2, 0) == 0) {
-                    return 1;
-                }
-            }
+        if (len2 >= PATH_MAX) {
+            continue;
+        }
+
+        // fails for attributes and links, which saves a separate fstatat()
+        fd2 = openat(dirfd(dir), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
 
-            list_entry2 = udev_list_entry_get_next(list_entry2);
+        if (fd2 == -1) {
+            continue;
         }
 
-        list_entry = udev_list_entry_get_next(list_entry);
+        path[len] = '/';
+        strcpy(path + len + 1, de->d_name);
+        scan_subtree(udev_enumerate, fd2, path, len2);
+        path[len] = '\0';
     }
 
-    return 0;
+    closedir(dir);
 }
 
-static int filter_sysattr(struct udev_enumerate *udev_enumerate, struct udev_device *udev_device)
+static int scan_parent(struct udev_enumerate *udev_enumerate)
 {
-    const char *sysattr, *value, *value2;
-    struct udev_list_entry *list_entry;
+    char path[PATH_MAX];
+    int fd;
 
-    list_entry = udev_list_entry_get_next(&udev_enumerate->sysattr_nomatch);
+    snprintf(path, sizeof(path), "%s", udev_device_get_syspath(udev_enumerate->parent));
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 
-    while (list_entry) {
-        sysattr = udev_list_entry_get_name(list_entry);
-        value2 = udev_list_entry_get_value(list_entry);
-        value = udev_device_get_sysattr_value(udev_device, sysattr);
+    if (fd == -1) {
+        return -1;
+    }
 
-        if (value && value2 && fnmatch(value2, value, 0) == 0) {
-            return 0;
+    scan_subtree(udev_enumerate, fd, path, strlen(path));
+    return 0;
+}
+
+int udev_enumerate_scan_devices(struct udev_enumerate *udev_enumerate)
+{
+    const char *syspath;
+    uint32_t pos = 0;
+
+    if (!udev_enumerate) {
+        return -1;
+    }
+
+    // the database holds the same set of devices as sysfs scan below
+    if (udev_db_begin(udev_enumerate->udev) == 0) {
+        while (!udev_enumerate->stop && (syspath = udev_db_next(udev_enumerate->udev, &pos))) {
+            // built from memory, checking sysfs first would only cost more
+            if (filter_parent(udev_enumerate, syspath)) {
+                add_device(udev_enumerate, syspath, 0);
+            }
         }
 
-        list_entry = udev_list_entry_get_next(list_entry);
+        udev_db_end(udev_enumerate->udev);
+        return 0;
     }
 
-    list_entry = udev_list_entry_get_next(&udev_enumerate->sysattr_match);
+    if (udev_enumerate->parent) {
+        return scan_parent(udev_enumerate);
+    }
 
-    if (list_entry) {
-        while (list_entry) {
-            sysattr = udev_list_entry_get_name(list_entry);
-            value2 = udev_list_entry_get_value(list_entry);
-            value = udev_device_get_sysattr_value(udev_device, sysattr);
+    // streaming hands devices over in order as soon as they are found
+    if (udev_enumerate->threads > 1 && !udev_enumerate->scan_fn) {
+        return scan_devices_parallel(udev_enumerate);
+    }
 
-            if (value && value2 && fnmatch(value2, value, 0) == 0) {
-                return 1;
-            }
+    return scan_subsystems(udev_enumerate, scan_devices, NULL);
+}
 
-            list_entry = udev_list_entry_get_next(list_entry);
-        }
+int udev_enumerate_scan_devices_cb(struct udev_enumerate *udev_enumerate,
+        int (*fn)(struct udev_device *udev_device, void *data), void *data)
+{
+    int ret;
 
-        return 0;
+    if (!udev_enumerate || !fn) {
+        return -1;
     }
 
-    return 1;
+    udev_enumerate->scan_fn = fn;
+    udev_enumerate->scan_data = data;
+
+    ret = udev_enumerate_scan_devices(udev_enumerate);
+
+    udev_enumerate->scan_fn = NULL;
+    udev_enumerate->scan_data = NULL;
+    udev_enumerate->stop = 0;
+    return ret;
 }
 
-static void add_device(struct udev_enumerate *udev_enumerate, const char *path)
+int udev_enumerate_set_threads(struct udev_enumerate *udev_enumerate, int threads)
 {
-    struct udev_device *udev_device;
+    if (!udev_enumerate || threads < 0) {
+        return -1;
+    }
 
-    udev_device = udev_device_new_from_syspath(udev_enumerate->udev, path);
+    udev_enumerate->threads = threads;
+    return 0;
+}
 
-    if (!udev_device) {
-        return;
+// same set as systemd reports: modules, buses and classes as "subsystem"
+// devices and drivers of every bus. none of them is a device, see
+// new_device() in udev_device.c
+int udev_enumerate_scan_subsystems(struct udev_enumerate *udev_enumerate)
+{
+    struct udev_list_entry subsystems, *list_entry;
+    int subsystem, drivers;
+    char path[PATH_MAX];
+    const char *name;
+
+    if (!udev_enumerate) {
+        return -1;
     }
 
-    if (!filter_subsystem(udev_enumerate, udev_device) ||
-        !filter_sysname(udev_enumerate, udev_device) ||
-        !filter_property(udev_enumerate, udev_device) ||
-        !filter_sysattr(udev_enumerate, udev_device)) {
-        udev_device_unref(udev_device);
-        return;
+    if (filter_subsystem(udev_enumerate, "module")) {
+        scan_devices(udev_enumerate, "/sys/module", NULL);
+    }
+
+    subsystem = filter_subsystem(udev_enumerate, "subsystem");
+    drivers = filter_subsystem(udev_enumerate, "drivers");
+
+    if (!subsystem && !drivers) {
+        return 0;
+    }
+
+    udev_list_entry_init(&subsystems);
+
+    if (udev_subsystems_get(udev_enumerate->udev, &subsystems) == -1) {
+        udev_list_entry_free_all(&subsystems);
+        return -1;
     }
 
-    udev_list_entry_add(&udev_enumerate->devices, udev_device_get_syspath(udev_device), NULL, 0);
+    udev_list_entry_foreach(list_entry, udev_list_entry_get_next(&subsystems)) {
+        name = udev_list_entry_get_name(list_entry);
+
+        if (subsystem) {
+            add_device(udev_enumerate, name, 1);
+        }
+
+        if (drivers && strncmp(name, "/sys/bus/", 9) == 0) {
+            snprintf(path, sizeof(path), "%s/drivers", name);
+            scan_devices(udev_enumerate, path, NULL);
+        }
+    }
 
-    udev_device_unref(udev_device);
+    udev_list_entry_free_all(&subsystems);
+    return 0;
 }
 
-static int filter_dot(const struct dirent *de)
+// returns whether the result list or a device in it has changed. devices
+// are checked as they come from the event, the same way monitor does
+static int apply_event(struct udev_enumerate *udev_enumerate, struct udev_device *udev_device)
 {
-    return de->d_name[0] != '.';
+    const char *syspath, *action, *devpath_old;
+    char path[PATH_MAX];
+    int changed = 0;
+
+    syspath = udev_device_get_syspath(udev_device);
+    action = udev_device_get_action(udev_device);
+    devpath_old = udev_device_get_property_value(udev_device, "DEVPATH_OLD");
+
+    if (devpath_old) {
+        snprintf(path, sizeof(path), "/sys%s", devpath_old);
+        changed = remove_result(udev_enumerate, path);
+    }
+
+    if (strcmp(action, "remove") == 0) {
+        return remove_result(udev_enumerate, syspath) || changed;
+    }
+
+    // syspaths added by the caller bypass the filters, the same as in
+    // udev_enumerate_add_syspath()
+    if (udev_list_entry_get_by_name(udev_list_entry_get_next(&udev_enumerate->added), syspath)) {
+        add_result(udev_enumerate, syspath);
+        udev_device_unref(udev_hash_remove(&udev_enumerate->built, syspath));
+        return 1;
+    }
+
+    // scans only find devices there, modules and such are left out
+    if (strncmp(syspath, "/sys/devices/", 13) != 0 ||
+        !filter_parent(udev_enumerate, syspath) ||
+        !filter_sysname(udev_enumerate, udev_device_get_sysname(udev_device)) ||
+        !match_device(udev_enumerate, udev_device, 0)) {
+        return remove_result(udev_enumerate, syspath) || changed;
+    }
+
+    add_result(udev_enumerate, syspath);
+
+    // the device has changed, the next udev_enumerate_get_device() builds it
+    udev_device_unref(udev_hash_remove(&udev_enumerate->built, syspath));
+    return 1;
 }
 
-static int scan_devices(struct udev_enumerate *udev_enumerate, const char *path)
+// the socket has overflowed and events are lost, so the list is rebuilt
+static void resync(struct udev_enumerate *udev_enumerate)
 {
-    int i, cnt;
-    struct dirent **de;
+    struct udev_list_entry *list_entry;
+    struct stat st;
 
-    cnt = scandir(path, &de, filter_dot, NULL);
+    free_results(udev_enumerate);
+    udev_enumerate_scan_devices(udev_enumerate);
 
-    if (cnt == -1) {
-        return 0;
+    udev_list_entry_foreach(list_entry, udev_list_entry_get_next(&udev_enumerate->added)) {
+        if (stat(udev_list_entry_get_name(list_entry), &st) == 0) {
+            add_result(udev_enumerate, udev_list_entry_get_name(list_entry));
+        }
     }
+    udev_enumerate->generation++;
 
-    for (i = 0; i < cnt; i++) {
-        char device_path[PATH_MAX];
-        snprintf(device_path, sizeof(device_path), "%s/%s", path, de[i]->d_name);
-        add_device(udev_enumerate, device_path);
+    if (udev_enumerate->live_fn) {
+        udev_enumerate->live_fn(udev_enumerate, NULL, udev_enumerate->live_data);
     }
+}
 
-    for (i = 0; i < cnt; i++) {
-        free(de[i]);
+// the monitor drops events of other subsystems before building a device.
+// subsystem patterns and nomatches can't be expressed, so they leave the
+// subsystem unfiltered. tag filters would drop events of added syspaths
+// without those tags, so they are only installed if there are none
+static void filter_monitor(struct udev_enumerate *udev_enumerate)
+{
+    struct udev_list_entry *list_entry;
+    struct udev_monitor *udev_monitor = udev_enumerate->monitor;
+
+    udev_monitor_filter_remove(udev_monitor);
+
+    if (udev_list_entry_get_next(&udev_enumerate->subsystem_match) && !udev_enumerate->subsystems.patterns) {
+        udev_list_entry_foreach(list_entry, udev_list_entry_get_next(&udev_enumerate->subsystem_match)) {
+            udev_monitor_filter_add_match_subsystem_devtype(udev_monitor, udev_list_entry_get_name(list_entry), NULL);
+        }
+
+        udev_list_entry_foreach(list_entry, udev_list_entry_get_next(&udev_enumerate->added)) {
+            if (udev_list_entry_get_value(list_entry)) {
+                udev_monitor_filter_add_match_subsystem_devtype(udev_monitor, udev_list_entry_get_value(list_entry), NULL);
+            }
+        }
     }
 
-    free(de);
-    return 1;
+    if (!udev_list_entry_get_next(&udev_enumerate->added)) {
+        udev_list_entry_foreach(list_entry, udev_list_entry_get_next(&udev_enumerate->tag_match)) {
+            udev_monitor_filter_add_match_tag(udev_monitor, udev_list_entry_get_name(list_entry));
+        }
+    }
 }
 
-int udev_enumerate_scan_devices(struct udev_enumerate *udev_enumerate)
+int udev_enumerate_enable_live(struct udev_enumerate *udev_enumerate,
+        void (*fn)(struct udev_enumerate *udev_enumerate, struct udev_device *udev_device, void *data), void *data)
 {
-    const char *path[] = { "/sys/dev/block", "/sys/dev/char", NULL };
-    int i;
+    if (!udev_enumerate || udev_enumerate->monitor) {
+        return -1;
+    }
 
-    if (!udev_enumerate) {
+    udev_enumerate->monitor = udev_monitor_new_from_netlink(udev_enumerate->udev, "udev");
+
+    if (!udev_enumerate->monitor) {
         return -1;
     }
 
-    for (i = 0; path[i]; i++) {
-        if (!scan_devices(udev_enumerate, path[i])) {
-            return -1;
-        }
+    if (udev_monitor_enable_receiving(udev_enumerate->monitor) == -1) {
+        udev_enumerate->monitor = udev_monitor_unref(udev_enumerate->monitor);
+        return -1;
     }
 
+    filter_monitor(udev_enumerate);
+
+    udev_enumerate->live_fn = fn;
+    udev_enumerate->live_data = data;
     return 0;
 }
 
-/* XXX NOT IMPLEMENTED */ int udev_enumerate_scan_subsystems(struct udev_enumerate *udev_enumerate)
+int udev_enumerate_get_fd(struct udev_enumerate *udev_enumerate)
 {
-    return 0;
+    return udev_enumerate && udev_enumerate->monitor ? udev_monitor_get_fd(udev_enumerate->monitor) : -1;
+}
+
+unsigned long udev_enumerate_get_generation(struct udev_enumerate *udev_enumerate)
+{
+    return udev_enumerate ? udev_enumerate->generation : 0;
+}
+
+int udev_enumerate_process(struct udev_enumerate *udev_enumerate)
+{
+    struct udev_device *udev_device;
+    int cnt = 0;
+
+    if (!udev_enumerate || !udev_enumerate->monitor) {
+        return -1;
+    }
+
+    while (1) {
+        errno = 0;
+        udev_device = udev_monitor_receive_device(udev_enumerate->monitor);
+
+        if (!udev_device) {
+            break;
+        }
+
+        if (apply_event(udev_enumerate, udev_device)) {
+            udev_enumerate->generation++;
+            cnt++;
+
+            if (udev_enumerate->live_fn) {
+                udev_enumerate->live_fn(udev_enumerate, udev_device, udev_enumerate->live_data);
+            }
+        }
+
+        udev_device_unref(udev_device);
+    }
+
+    if (errno == ENOBUFS) {
+        resync(udev_enumerate);
+        cnt++;
+    }
+
+    return cnt;
 }
 
 struct udev_list_entry *udev_enumerate_get_list_entry(struct udev_enumerate *udev_enumerate)
@@ -304,9 +1418,52 @@ struct udev_list_entry *udev_enumerate_get_list_entry(struct udev_enumerate *ude
     return udev_enumerate ? udev_list_entry_get_next(&udev_enumerate->devices) : NULL;
 }
 
-/* XXX NOT IMPLEMENTED */ int udev_enumerate_add_syspath(struct udev_enumerate *udev_enumerate, const char *syspath)
+struct udev_device *udev_enumerate_get_device(struct udev_enumerate *udev_enumerate, struct udev_list_entry *list_entry)
 {
-    return 0;
+    struct udev_device *udev_device;
+    const char *syspath;
+
+    if (!udev_enumerate || !list_entry) {
+        return NULL;
+    }
+
+    syspath = udev_list_entry_get_name(list_entry);
+    udev_device = udev_hash_get(&udev_enumerate->built, syspath);
+
+    if (udev_device) {
+        return udev_device_ref(udev_device);
+    }
+
+    return udev_device_new_from_syspath(udev_enumerate->udev, syspath);
+}
+
+// like systemd, the device is added without checking filters
+int udev_enumerate_add_syspath(struct udev_enumerate *udev_enumerate, const char *syspath)
+{
+    struct udev_device *udev_device;
+
+    if (!udev_enumerate || !syspath) {
+        return -1;
+    }
+
+    udev_device = udev_device_new_from_syspath(udev_enumerate->udev, syspath);
+
+    if (!udev_device) {
+        return -1;
+    }
+
+    // remembered, so that live updates don't filter it out
+    if (!udev_list_entry_add(&udev_enumerate->added, udev_device_get_syspath(udev_device),
+                udev_device_get_subsystem(udev_device), 1)) {
+        udev_device_unref(udev_device);
+        return -1;
+    }
+
+    if (udev_enumerate->monitor) {
+        filter_monitor(udev_enumerate);
+    }
+
+    return store_device(udev_enumerate, udev_device);
 }
 
 struct udev *udev_enumerate_get_udev(struct udev_enumerate *udev_enumerate)
@@ -331,13 +1488,17 @@ struct udev_enumerate *udev_enumerate_new(struct udev *udev)
     udev_enumerate->refcount = 1;
     udev_enumerate->udev = udev;
 
-    udev_list_entry_init(&udev_enumerate->subsystem_nomatch);
     udev_list_entry_init(&udev_enumerate->subsystem_match);
-    udev_list_entry_init(&udev_enumerate->sysattr_nomatch);
-    udev_list_entry_init(&udev_enumerate->property_match);
-    udev_list_entry_init(&udev_enumerate->sysattr_match);
-    udev_list_entry_init(&udev_enumerate->sysname_match);
+    udev_list_entry_init(&udev_enumerate->tag_match);
+    udev_list_entry_init(&udev_enumerate->added);
     udev_list_entry_init(&udev_enumerate->devices);
+    udev_enumerate->devices_tail = &udev_enumerate->devices;
+
+    udev_hash_init(&udev_enumerate->subsystems.literals);
+    udev_hash_init(&udev_enumerate->nosubsystems.literals);
+    udev_hash_init(&udev_enumerate->sysnames.literals);
+    udev_hash_init(&udev_enumerate->results);
+    udev_hash_init(&udev_enumerate->built);
 
     return udev_enumerate;
 }
@@ -348,7 +1509,7 @@ struct udev_enumerate *udev_enumerate_ref(struct udev_enumerate *udev_enumerate)
         return NULL;
     }
 
-    udev_enumerate->refcount++;
+    __atomic_add_fetch(&udev_enumerate->refcount, 1, __ATOMIC_RELAXED);
     return udev_enumerate;
 }
 
@@ -358,17 +1519,22 @@ struct udev_enumerate *udev_enumerate_unref(struct udev_enumerate *udev_enumerat
         return NULL;
     }
 
-    if (--udev_enumerate->refcount > 0) {
+    if (__atomic_sub_fetch(&udev_enumerate->refcount, 1, __ATOMIC_ACQ_REL) > 0) {
         return NULL;
     }
 
-    udev_list_entry_free_all(&udev_enumerate->subsystem_nomatch);
     udev_list_entry_free_all(&udev_enumerate->subsystem_match);
-    udev_list_entry_free_all(&udev_enumerate->sysattr_nomatch);
-    udev_list_entry_free_all(&udev_enumerate->property_match);
-    udev_list_entry_free_all(&udev_enumerate->sysattr_match);
-    udev_list_entry_free_all(&udev_enumerate->sysname_match);
-    udev_list_entry_free_all(&udev_enumerate->devices);
+    udev_list_entry_free_all(&udev_enumerate->tag_match);
+    udev_list_entry_free_all(&udev_enumerate->added);
+    free_matcher(&udev_enumerate->subsystems);
+    free_matcher(&udev_enumerate->nosubsystems);
+    free_matcher(&udev_enumerate->sysnames);
+    free_matches(udev_enumerate->properties);
+    free_matches(udev_enumerate->sysattrs);
+    free_matches(udev_enumerate->nosysattrs);
+    free_results(udev_enumerate);
+    udev_device_unref(udev_enumerate->parent);
+    udev_monitor_unref(udev_enumerate->monitor);
 
     free(udev_enumerate);
     return NULL;
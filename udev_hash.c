@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2020-2021 illiliti <illiliti@protonmail.com>
+ * SPDX-License-Identifier: ISC
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "udev_hash.h"
+
+// FNV-1a
+// http://www.isthe.com/chongo/tech/comp/fnv/index.html#FNV-1a
+unsigned long udev_hash_string(const char *str)
+{
+    unsigned long hash = 2166136261UL;
+
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619UL;
+    }
+
+    return hash;
+}
+
+void udev_hash_init(struct udev_hash *hash)
+{
+    hash->buckets = NULL;
+    hash->count = 0;
+    hash->size = 0;
+}
+
+void udev_hash_free(struct udev_hash *hash, void (*free_value)(void *))
+{
+    struct udev_hash_entry *entry, *next;
+    size_t i;
+
+    for (i = 0; i < hash->size; i++) {
+        for (entry = hash->buckets[i]; entry; entry = next) {
+            next = entry->next;
+
+            if (free_value) {
+                free_value(entry->value);
+            }
+
+            free(entry->key);
+            free(entry);
+        }
+    }
+
+    free(hash->buckets);
+    udev_hash_init(hash);
+}
+
+static struct udev_hash_entry **lookup(struct udev_hash *hash, const char *key, unsigned long hash2)
+{
+    struct udev_hash_entry **entry;
+
+    if (!hash->size) {
+        return NULL;
+    }
+
+    for (entry = &hash->buckets[hash2 & (hash->size - 1)]; *entry; entry = &(*entry)->next) {
+        if ((*entry)->hash == hash2 && strcmp((*entry)->key, key) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static int resize(struct udev_hash *hash)
+{
+    struct udev_hash_entry **buckets, *entry, *next;
+    size_t i, size;
+
+    size = hash->size ? hash->size * 2 : 64;
+    buckets = calloc(size, sizeof(*buckets));
+
+    if (!buckets) {
+        return -1;
+    }
+
+    for (i = 0; i < hash->size; i++) {
+        for (entry = hash->buckets[i]; entry; entry = next) {
+            next = entry->next;
+            entry->next = buckets[entry->hash & (size - 1)];
+            buckets[entry->hash & (size - 1)] = entry;
+        }
+    }
+
+    free(hash->buckets);
+    hash->buckets = buckets;
+    hash->size = size;
+    return 0;
+}
+
+void *udev_hash_get(struct udev_hash *hash, const char *key)
+{
+    struct udev_hash_entry **entry;
+
+    entry = lookup(hash, key, udev_hash_string(key));
+    return entry ? (*entry)->value : NULL;
+}
+
+int udev_hash_set(struct udev_hash *hash, const char *key, void *value)
+{
+    struct udev_hash_entry **entry, *entry2;
+    unsigned long hash2;
+
+    hash2 = udev_hash_string(key);
+    entry = lookup(hash, key, hash2);
+
+    if (entry) {
+        (*entry)->value = value;
+        return 0;
+    }
+
+    if (hash->count >= hash->size / 2 && resize(hash) == -1) {
+        return -1;
+    }
+
+    entry2 = calloc(1, sizeof(*entry2));
+
+    if (!entry2) {
+        return -1;
+    }
+
+    entry2->key = strdup(key);
+
+    if (!entry2->key) {
+        free(entry2);
+        return -1;
+    }
+
+    entry2->hash = hash2;
+    entry2->value = value;
+    entry2->next = hash->buckets[hash2 & (hash->size - 1)];
+    hash->buckets[hash2 & (hash->size - 1)] = entry2;
+    hash->count++;
+    return 0;
+}
+
+void *udev_hash_remove(struct udev_hash *hash, const char *key)
+{
+    struct udev_hash_entry **entry, *entry2;
+    void *value;
+
+    entry = lookup(hash, key, udev_hash_string(key));
+
+    if (!entry) {
+        return NULL;
+    }
+
+    entry2 = *entry;
+    *entry = entry2->next;
+    value = entry2->value;
+
+    free(entry2->key);
+    free(entry2);
+    hash->count--;
+    return value;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2020-2021 illiliti <illiliti@protonmail.com>
+ * SPDX-License-Identifier: ISC
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+struct udev_hash_entry {
+    struct udev_hash_entry *next;
+    unsigned long hash;
+    void *value;
+    char *key;
+};
+
+struct udev_hash {
+    struct udev_hash_entry **buckets;
+    size_t count;
+    size_t size;
+};
+
+unsigned long udev_hash_string(const char *str);
+void udev_hash_init(struct udev_hash *hash);
+void udev_hash_free(struct udev_hash *hash, void (*free_value)(void *));
+void *udev_hash_get(struct udev_hash *hash, const char *key);
+int udev_hash_set(struct udev_hash *hash, const char *key, void *value);
+void *udev_hash_remove(struct udev_hash *hash, const char *key);
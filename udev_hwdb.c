@@ -0,0 +1,689 @@
+/*
+ * Copyright (c) 2020-2021 illiliti <illiliti@protonmail.com>
+ * SPDX-License-Identifier: ISC
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "udev.h"
+#include "udev_list.h"
+
+// reader for the compiled hwdb.bin produced by systemd-hwdb(8) and udevadm.
+// the file is mapped read-only and walked in place, nothing is parsed on open.
+// https://github.com/systemd/systemd/blob/v251/src/libsystemd/sd-hwdb/hwdb-internal.h
+
+#define HWDB_SIG "KSLPHHRH"
+#define HWDB_CACHE_SIZE 8
+
+// offsets of fields inside of on-disk structures
+#define HEADER_FILE_SIZE 16
+#define HEADER_HEADER_SIZE 24
+#define HEADER_NODE_SIZE 32
+#define HEADER_CHILD_ENTRY_SIZE 40
+#define HEADER_VALUE_ENTRY_SIZE 48
+#define HEADER_NODES_ROOT_OFF 56
+#define HEADER_MIN_SIZE 80
+
+#define NODE_PREFIX_OFF 0
+#define NODE_CHILDREN_COUNT 8
+#define NODE_VALUES_COUNT 16
+#define NODE_MIN_SIZE 24
+
+#define CHILD_C 0
+#define CHILD_OFF 8
+#define CHILD_MIN_SIZE 16
+
+#define VALUE_KEY_OFF 0
+#define VALUE_VALUE_OFF 8
+#define VALUE_LINE_NUMBER 24
+#define VALUE_FILE_PRIORITY 28
+#define VALUE_MIN_SIZE 16
+#define VALUE2_MIN_SIZE 32
+
+// without hwdb.bin, vendor and model names are looked up in a table built
+// from pci.ids and usb.ids by contrib/hwids.c. see there for the layout.
+#ifndef UDEV_HWIDS_PATH
+#define UDEV_HWIDS_PATH "/usr/share/libudev-zero/hwids.bin"
+#endif
+
+#define HWIDS_SIG "LUZHWID1"
+#define HWIDS_COUNT 8
+#define HWIDS_STRINGS_OFF 12
+#define HWIDS_HEADER_SIZE 16
+#define HWIDS_ENTRY_SIZE 16
+#define HWIDS_NAME_OFF 12
+#define HWIDS_KEY_LEN 6
+
+enum {
+    HWIDS_BUS_PCI,
+    HWIDS_BUS_USB,
+};
+
+enum {
+    HWIDS_VENDOR,
+    HWIDS_DEVICE,
+    HWIDS_SUBSYSTEM,
+};
+
+struct hwdb_cache {
+    struct udev_list_entry properties;
+    char *modalias;
+};
+
+struct udev_hwdb {
+    struct hwdb_cache cache[HWDB_CACHE_SIZE];
+    uint64_t child_entry_size;
+    uint64_t value_entry_size;
+    uint64_t node_size;
+    uint64_t root;
+    uint32_t ids_strings;
+    uint32_t ids_count;
+    const unsigned char *map;
+    size_t size;
+    int is_ids;
+    int refcount;
+};
+
+struct hwdb_match {
+    const char *key;
+    const char *value;
+    uint64_t priority;
+};
+
+struct hwdb_search {
+    struct hwdb_match *matches;
+    size_t cnt, len;
+    char buf[4096];
+    size_t buf_len;
+};
+
+static uint64_t le64(const unsigned char *p)
+{
+    uint64_t val = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        val = (val << 8) | p[i];
+    }
+
+    return val;
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static const unsigned char *get_node(struct udev_hwdb *hwdb, uint64_t off)
+{
+    if (off < HEADER_MIN_SIZE || off > hwdb->size || hwdb->size - off < hwdb->node_size) {
+        return NULL;
+    }
+
+    return hwdb->map + off;
+}
+
+static const char *get_string(struct udev_hwdb *hwdb, uint64_t off)
+{
+    return off >= HEADER_MIN_SIZE && off < hwdb->size ? (const char *)hwdb->map + off : "";
+}
+
+static const unsigned char *get_child(struct udev_hwdb *hwdb, const unsigned char *node, size_t idx)
+{
+    return node + hwdb->node_size + idx * hwdb->child_entry_size;
+}
+
+static const unsigned char *get_value(struct udev_hwdb *hwdb, const unsigned char *node, size_t idx)
+{
+    return node + hwdb->node_size + node[NODE_CHILDREN_COUNT] * hwdb->child_entry_size + idx * hwdb->value_entry_size;
+}
+
+static int check_node(struct udev_hwdb *hwdb, const unsigned char *node)
+{
+    uint64_t len;
+
+    len = hwdb->node_size + node[NODE_CHILDREN_COUNT] * hwdb->child_entry_size;
+
+    if ((size_t)(hwdb->map + hwdb->size - node) < len) {
+        return 0;
+    }
+
+    return (hwdb->size - (node - hwdb->map) - len) / hwdb->value_entry_size >= le64(node + NODE_VALUES_COUNT);
+}
+
+// children are sorted by character, see trie_node_add_value() in systemd
+static const unsigned char *lookup_child(struct udev_hwdb *hwdb, const unsigned char *node, unsigned char c)
+{
+    const unsigned char *child;
+    size_t lo, hi, mid;
+
+    lo = 0;
+    hi = node[NODE_CHILDREN_COUNT];
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        child = get_child(hwdb, node, mid);
+
+        if (child[CHILD_C] == c) {
+            return get_node(hwdb, le64(child + CHILD_OFF));
+        }
+
+        if (child[CHILD_C] < c) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    return NULL;
+}
+
+static void add_match(struct hwdb_search *search, const char *key, const char *value, uint64_t priority)
+{
+    struct hwdb_match *matches;
+    size_t i;
+
+    for (i = 0; i < search->cnt; i++) {
+        if (strcmp(search->matches[i].key, key) == 0) {
+            if (search->matches[i].priority <= priority) {
+                search->matches[i].value = value;
+                search->matches[i].priority = priority;
+            }
+
+            return;
+        }
+    }
+
+    if (search->cnt == search->len) {
+        matches = realloc(search->matches, (search->len * 2 + 8) * sizeof(*matches));
+
+        if (!matches) {
+            return;
+        }
+
+        search->matches = matches;
+        search->len = search->len * 2 + 8;
+    }
+
+    search->matches[search->cnt].key = key;
+    search->matches[search->cnt].value = value;
+    search->matches[search->cnt].priority = priority;
+    search->cnt++;
+}
+
+static void add_value(struct udev_hwdb *hwdb, struct hwdb_search *search, const unsigned char *value)
+{
+    const char *key;
+    uint64_t priority = 0;
+
+    key = get_string(hwdb, le64(value + VALUE_KEY_OFF));
+
+    // keys which do not start with a space are reserved for future extensions
+    if (key[0] != ' ') {
+        return;
+    }
+
+    // on duplicates, the last one by file priority and line number wins
+    if (hwdb->value_entry_size >= VALUE2_MIN_SIZE) {
+        priority = ((uint64_t)(value[VALUE_FILE_PRIORITY] | value[VALUE_FILE_PRIORITY + 1] << 8) << 32) |
+            ((uint64_t)value[VALUE_LINE_NUMBER] | (uint64_t)value[VALUE_LINE_NUMBER + 1] << 8 |
+             (uint64_t)value[VALUE_LINE_NUMBER + 2] << 16 | (uint64_t)value[VALUE_LINE_NUMBER + 3] << 24);
+    }
+
+    add_match(search, key + 1, get_string(hwdb, le64(value + VALUE_VALUE_OFF)), priority);
+}
+
+static void add_values(struct udev_hwdb *hwdb, struct hwdb_search *search, const unsigned char *node)
+{
+    uint64_t i;
+
+    for (i = 0; i < le64(node + NODE_VALUES_COUNT); i++) {
+        add_value(hwdb, search, get_value(hwdb, node, i));
+    }
+}
+
+// collect the pattern spelled by the remaining subtree and glob it against
+// the rest of modalias
+static void search_fnmatch(struct udev_hwdb *hwdb, struct hwdb_search *search, const unsigned char *node, size_t p, const char *modalias)
+{
+    const unsigned char *child;
+    const char *prefix;
+    size_t i, len;
+
+    if (!node || !check_node(hwdb, node)) {
+        return;
+    }
+
+    prefix = get_string(hwdb, le64(node + NODE_PREFIX_OFF)) + p;
+    len = strlen(prefix);
+
+    if (search->buf_len + len + 2 > sizeof(search->buf)) {
+        return;
+    }
+
+    memcpy(search->buf + search->buf_len, prefix, len);
+    search->buf_len += len;
+
+    for (i = 0; i < node[NODE_CHILDREN_COUNT]; i++) {
+        child = get_child(hwdb, node, i);
+        search->buf[search->buf_len++] = child[CHILD_C];
+        search_fnmatch(hwdb, search, get_node(hwdb, le64(child + CHILD_OFF)), 0, modalias);
+        search->buf_len--;
+    }
+
+    search->buf[search->buf_len] = '\0';
+
+    if (le64(node + NODE_VALUES_COUNT) && fnmatch(search->buf, modalias, 0) == 0) {
+        add_values(hwdb, search, node);
+    }
+
+    search->buf_len -= len;
+}
+
+static void search_glob_child(struct udev_hwdb *hwdb, struct hwdb_search *search, const unsigned char *node, char c, const char *modalias)
+{
+    const unsigned char *child;
+
+    child = lookup_child(hwdb, node, c);
+
+    if (!child || search->buf_len + 1 >= sizeof(search->buf)) {
+        return;
+    }
+
+    search->buf[search->buf_len++] = c;
+    search_fnmatch(hwdb, search, child, 0, modalias);
+    search->buf_len--;
+}
+
+static void search_trie(struct udev_hwdb *hwdb, struct hwdb_search *search, const char *modalias)
+{
+    const unsigned char *node;
+    const char *prefix;
+    size_t i = 0, p;
+
+    node = get_node(hwdb, hwdb->root);
+
+    while (node && check_node(hwdb, node)) {
+        if (le64(node + NODE_PREFIX_OFF)) {
+            prefix = get_string(hwdb, le64(node + NODE_PREFIX_OFF));
+
+            for (p = 0; prefix[p]; p++) {
+                if (prefix[p] == '*' || prefix[p] == '?' || prefix[p] == '[') {
+                    search_fnmatch(hwdb, search, node, p, modalias + i + p);
+                    return;
+                }
+
+                if (prefix[p] != modalias[i + p]) {
+                    return;
+                }
+            }
+
+            i += p;
+        }
+
+        search_glob_child(hwdb, search, node, '*', modalias + i);
+        search_glob_child(hwdb, search, node, '?', modalias + i);
+        search_glob_child(hwdb, search, node, '[', modalias + i);
+
+        if (modalias[i] == '\0') {
+            add_values(hwdb, search, node);
+            return;
+        }
+
+        node = lookup_child(hwdb, node, modalias[i++]);
+    }
+}
+
+// entry: bus, vendor, device, subvendor, subdevice as le16, level as u8,
+// one byte of padding and le32 offset of the name in the string table
+static const char *lookup_ids(struct udev_hwdb *hwdb, const unsigned int *key)
+{
+    const unsigned char *entry;
+    size_t lo, hi, mid;
+    unsigned int val;
+    uint32_t off;
+    int i, cmp;
+
+    lo = 0;
+    hi = hwdb->ids_count;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        entry = hwdb->map + HWIDS_HEADER_SIZE + mid * HWIDS_ENTRY_SIZE;
+
+        for (i = 0, cmp = 0; i < HWIDS_KEY_LEN && !cmp; i++) {
+            val = i < HWIDS_KEY_LEN - 1 ? (unsigned int)(entry[i * 2] | entry[i * 2 + 1] << 8) : entry[i * 2];
+            cmp = (key[i] > val) - (key[i] < val);
+        }
+
+        if (!cmp) {
+            off = le32(entry + HWIDS_NAME_OFF);
+            return off < hwdb->size - hwdb->ids_strings ? (const char *)hwdb->map + hwdb->ids_strings + off : NULL;
+        }
+
+        if (cmp > 0) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    return NULL;
+}
+
+static int parse_id(const char **str, const char *prefix, int digits, unsigned int *val)
+{
+    const char *pos;
+    int i;
+
+    if (strncmp(*str, prefix, strlen(prefix)) != 0) {
+        return 0;
+    }
+
+    pos = *str + strlen(prefix);
+
+    for (i = 0, *val = 0; i < digits; i++) {
+        if (pos[i] >= '0' && pos[i] <= '9') {
+            *val = (*val << 4) | (pos[i] - '0');
+        }
+        else if (pos[i] >= 'A' && pos[i] <= 'F') {
+            *val = (*val << 4) | (pos[i] - 'A' + 10);
+        }
+        else if (pos[i] >= 'a' && pos[i] <= 'f') {
+            *val = (*val << 4) | (pos[i] - 'a' + 10);
+        }
+        else {
+            return 0;
+        }
+    }
+
+    *str = pos + digits;
+    return 1;
+}
+
+// pci:v00008086d00001234sv00001028sd00000001* and usb:v046DpC52B*
+static void search_ids(struct udev_hwdb *hwdb, struct hwdb_search *search, const char *modalias)
+{
+    unsigned int key[HWIDS_KEY_LEN] = {0};
+    const char *name;
+    int digits;
+
+    if (strncmp(modalias, "pci:", 4) == 0) {
+        key[0] = HWIDS_BUS_PCI;
+        digits = 8;
+    }
+    else if (strncmp(modalias, "usb:", 4) == 0) {
+        key[0] = HWIDS_BUS_USB;
+        digits = 4;
+    }
+    else {
+        return;
+    }
+
+    modalias += 4;
+
+    if (!parse_id(&modalias, "v", digits, &key[1]) || key[1] > 0xffff) {
+        return;
+    }
+
+    key[5] = HWIDS_VENDOR;
+
+    if ((name = lookup_ids(hwdb, key))) {
+        add_match(search, "ID_VENDOR_FROM_DATABASE", name, 0);
+    }
+
+    if (!parse_id(&modalias, key[0] == HWIDS_BUS_PCI ? "d" : "p", digits, &key[2]) || key[2] > 0xffff) {
+        return;
+    }
+
+    key[5] = HWIDS_DEVICE;
+
+    if ((name = lookup_ids(hwdb, key))) {
+        add_match(search, "ID_MODEL_FROM_DATABASE", name, 0);
+    }
+
+    if (key[0] != HWIDS_BUS_PCI ||
+        !parse_id(&modalias, "sv", digits, &key[3]) || key[3] > 0xffff ||
+        !parse_id(&modalias, "sd", digits, &key[4]) || key[4] > 0xffff) {
+        return;
+    }
+
+    key[5] = HWIDS_SUBSYSTEM;
+
+    // subsystem name is more specific than the device name
+    if ((name = lookup_ids(hwdb, key))) {
+        add_match(search, "ID_MODEL_FROM_DATABASE", name, 1);
+    }
+}
+
+static void cache_free(struct hwdb_cache *cache)
+{
+    udev_list_entry_free_all(&cache->properties);
+    udev_list_entry_init(&cache->properties);
+    free(cache->modalias);
+    cache->modalias = NULL;
+}
+
+struct udev_list_entry *udev_hwdb_get_properties_list_entry(struct udev_hwdb *hwdb, const char *modalias, unsigned int flags)
+{
+    struct hwdb_search search = {0};
+    struct hwdb_cache cache;
+    size_t i;
+
+    if (!hwdb || !modalias) {
+        return NULL;
+    }
+
+    // most recently used entry is kept first
+    for (i = 0; i < HWDB_CACHE_SIZE && hwdb->cache[i].modalias; i++) {
+        if (strcmp(hwdb->cache[i].modalias, modalias) == 0) {
+            cache = hwdb->cache[i];
+            memmove(&hwdb->cache[1], &hwdb->cache[0], i * sizeof(cache));
+            hwdb->cache[0] = cache;
+            return udev_list_entry_get_next(&hwdb->cache[0].properties);
+        }
+    }
+
+    cache_free(&hwdb->cache[HWDB_CACHE_SIZE - 1]);
+    memmove(&hwdb->cache[1], &hwdb->cache[0], (HWDB_CACHE_SIZE - 1) * sizeof(cache));
+    udev_list_entry_init(&hwdb->cache[0].properties);
+    hwdb->cache[0].modalias = strdup(modalias);
+
+    if (!hwdb->cache[0].modalias) {
+        return NULL;
+    }
+
+    if (hwdb->is_ids) {
+        search_ids(hwdb, &search, modalias);
+    }
+    else {
+        search_trie(hwdb, &search, modalias);
+    }
+
+    for (i = search.cnt; i-- > 0;) {
+        udev_list_entry_add(&hwdb->cache[0].properties, search.matches[i].key, search.matches[i].value, 0);
+    }
+
+    free(search.matches);
+    return udev_list_entry_get_next(&hwdb->cache[0].properties);
+}
+
+static const unsigned char *map_file(const char *path, size_t min, size_t *size)
+{
+    const unsigned char *map;
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)min) {
+        close(fd);
+        return NULL;
+    }
+
+    // shared mapping lets every process use the same page cache copy
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    *size = st.st_size;
+    return map;
+}
+
+static int open_trie(struct udev_hwdb *hwdb)
+{
+    const char *path[] = {
+        "/etc/systemd/hwdb/hwdb.bin",
+        "/etc/udev/hwdb.bin",
+        "/usr/lib/systemd/hwdb/hwdb.bin",
+        "/lib/systemd/hwdb/hwdb.bin",
+        "/usr/lib/udev/hwdb.bin",
+        "/lib/udev/hwdb.bin",
+        NULL
+    };
+    const unsigned char *map = NULL;
+    size_t size;
+    int i;
+
+    for (i = 0; path[i] && !map; i++) {
+        map = map_file(path[i], HEADER_MIN_SIZE, &size);
+    }
+
+    if (!map) {
+        return -1;
+    }
+
+    if (memcmp(map, HWDB_SIG, 8) != 0 || le64(map + HEADER_FILE_SIZE) != size ||
+        le64(map + HEADER_HEADER_SIZE) < HEADER_MIN_SIZE ||
+        le64(map + HEADER_NODE_SIZE) < NODE_MIN_SIZE ||
+        le64(map + HEADER_CHILD_ENTRY_SIZE) < CHILD_MIN_SIZE ||
+        le64(map + HEADER_VALUE_ENTRY_SIZE) < VALUE_MIN_SIZE) {
+        munmap((void *)map, size);
+        return -1;
+    }
+
+    hwdb->map = map;
+    hwdb->size = size;
+    hwdb->node_size = le64(map + HEADER_NODE_SIZE);
+    hwdb->child_entry_size = le64(map + HEADER_CHILD_ENTRY_SIZE);
+    hwdb->value_entry_size = le64(map + HEADER_VALUE_ENTRY_SIZE);
+    hwdb->root = le64(map + HEADER_NODES_ROOT_OFF);
+    return 0;
+}
+
+static int open_ids(struct udev_hwdb *hwdb)
+{
+    const unsigned char *map;
+    size_t size;
+
+    map = map_file(UDEV_HWIDS_PATH, HWIDS_HEADER_SIZE, &size);
+
+    if (!map) {
+        return -1;
+    }
+
+    // names are returned without bounds, so a non-empty string table must
+    // end with NUL
+    if (memcmp(map, HWIDS_SIG, 8) != 0 ||
+        (size - HWIDS_HEADER_SIZE) / HWIDS_ENTRY_SIZE < le32(map + HWIDS_COUNT) ||
+        le32(map + HWIDS_STRINGS_OFF) > size ||
+        (le32(map + HWIDS_STRINGS_OFF) < size && map[size - 1] != '\0')) {
+        munmap((void *)map, size);
+        return -1;
+    }
+
+    hwdb->map = map;
+    hwdb->size = size;
+    hwdb->ids_count = le32(map + HWIDS_COUNT);
+    hwdb->ids_strings = le32(map + HWIDS_STRINGS_OFF);
+    hwdb->is_ids = 1;
+    return 0;
+}
+
+struct udev_hwdb *udev_hwdb_new(struct udev *udev)
+{
+    struct udev_hwdb *hwdb;
+    int i;
+
+    if (!udev) {
+        return NULL;
+    }
+
+    hwdb = calloc(1, sizeof(*hwdb));
+
+    if (!hwdb) {
+        return NULL;
+    }
+
+    if (open_trie(hwdb) == -1 && open_ids(hwdb) == -1) {
+        free(hwdb);
+        return NULL;
+    }
+
+    hwdb->refcount = 1;
+
+    for (i = 0; i < HWDB_CACHE_SIZE; i++) {
+        udev_list_entry_init(&hwdb->cache[i].properties);
+    }
+
+    return hwdb;
+}
+
+struct udev_hwdb *udev_hwdb_ref(struct udev_hwdb *hwdb)
+{
+    if (!hwdb) {
+        return NULL;
+    }
+
+    __atomic_add_fetch(&hwdb->refcount, 1, __ATOMIC_RELAXED);
+    return hwdb;
+}
+
+struct udev_hwdb *udev_hwdb_unref(struct udev_hwdb *hwdb)
+{
+    int i;
+
+    if (!hwdb) {
+        return NULL;
+    }
+
+    if (__atomic_sub_fetch(&hwdb->refcount, 1, __ATOMIC_ACQ_REL) > 0) {
+        return NULL;
+    }
+
+    for (i = 0; i < HWDB_CACHE_SIZE; i++) {
+        cache_free(&hwdb->cache[i]);
+    }
+
+    munmap((void *)hwdb->map, hwdb->size);
+    free(hwdb);
+    return NULL;
+}
@@ -0,0 +1,573 @@
+/*
+ * Copyright (c) 2020-2021 illiliti <illiliti@protonmail.com>
+ * SPDX-License-Identifier: ISC
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "udev.h"
+#include "udev_list.h"
+#include "udev_hash.h"
+#include "udev_private.h"
+
+// identification properties of usb and block devices, the subset of
+// systemd's usb_id builtin and persistent storage rules that can be derived
+// from sysfs alone.
+//
+// attributes of a usb device or a disk are shared by every interface,
+// partition and child device below it, so they are computed once and kept
+// on struct udev. an entry is valid as long as the sysfs directory it was
+// read from is the same one, which is checked by inode.
+
+struct id_cache {
+    struct udev_list_entry properties;
+    ino_t ino;
+};
+
+static int read_attr(const char *syspath, const char *name, char *buf, size_t len)
+{
+    char path[PATH_MAX];
+    size_t cnt;
+    FILE *file;
+
+    snprintf(path, sizeof(path), "%s/%s", syspath, name);
+    file = fopen(path, "r");
+
+    if (!file) {
+        return -1;
+    }
+
+    cnt = fread(buf, 1, len - 1, file);
+    fclose(file);
+    buf[cnt] = '\0';
+
+    while (cnt > 0 && isspace((unsigned char)buf[cnt - 1])) {
+        buf[--cnt] = '\0';
+    }
+
+    return cnt > 0 ? 0 : -1;
+}
+
+// trim, turn runs of whitespace into single '_' and replace anything that
+// is not safe in a property value
+static void sanitize(char *dst, const char *src, size_t len)
+{
+    size_t i = 0;
+    int space = 0;
+
+    while (isspace((unsigned char)*src)) {
+        src++;
+    }
+
+    for (; *src && i + 1 < len; src++) {
+        if (isspace((unsigned char)*src)) {
+            space = 1;
+            continue;
+        }
+
+        if (space) {
+            dst[i++] = '_';
+            space = 0;
+
+            if (i + 1 >= len) {
+                break;
+            }
+        }
+
+        dst[i++] = (isalnum((unsigned char)*src) || strchr("#+-.:=@_", *src)) ? *src : '_';
+    }
+
+    dst[i] = '\0';
+}
+
+// escape whitespace and unsafe characters as \xNN
+static void encode(char *dst, const char *src, size_t len)
+{
+    size_t i = 0;
+
+    for (; *src && i + 4 < len; src++) {
+        if (isalnum((unsigned char)*src) || strchr("#+-.:=@_/", *src) || (unsigned char)*src >= 0x80) {
+            dst[i++] = *src;
+        }
+        else {
+            i += snprintf(dst + i, len - i, "\\x%02x", (unsigned char)*src);
+        }
+    }
+
+    dst[i] = '\0';
+}
+
+static void free_cache(void *ptr)
+{
+    struct id_cache *cache = ptr;
+
+    if (!cache) {
+        return;
+    }
+
+    udev_list_entry_free_all(&cache->properties);
+    free(cache);
+}
+
+void udev_id_free(struct udev *udev)
+{
+    udev_hash_free(&udev->id_cache, free_cache);
+}
+
+void udev_id_remove(struct udev *udev, const char *syspath)
+{
+    pthread_mutex_lock(&udev->lock);
+    free_cache(udev_hash_remove(&udev->id_cache, syspath));
+    pthread_mutex_unlock(&udev->lock);
+}
+
+static int copy_cache(struct udev_device *udev_device, struct id_cache *cache)
+{
+    struct udev_list_entry *list_entry;
+
+    if (!udev_list_entry_get_next(&cache->properties)) {
+        return -1;
+    }
+
+    udev_list_entry_foreach(list_entry, udev_list_entry_get_next(&cache->properties)) {
+        udev_device_add_property(udev_device, udev_list_entry_get_name(list_entry), udev_list_entry_get_value(list_entry));
+    }
+
+    return 0;
+}
+
+// properties are collected without the lock held, so that concurrent scans
+// only serialize on the copy. returns -1 if there are no properties
+static int get_cache(struct udev_device *udev_device, const char *syspath,
+        void (*fill)(struct id_cache *cache, const char *syspath, int usb), int usb)
+{
+    struct udev *udev = udev_device_get_udev(udev_device);
+    struct id_cache *cache, tmp;
+    struct stat st;
+    int ret;
+
+    // the device is gone, so is its entry
+    if (stat(syspath, &st) == -1) {
+        udev_id_remove(udev, syspath);
+        return -1;
+    }
+
+    pthread_mutex_lock(&udev->lock);
+    cache = udev_hash_get(&udev->id_cache, syspath);
+
+    if (cache && cache->ino == st.st_ino) {
+        ret = copy_cache(udev_device, cache);
+        pthread_mutex_unlock(&udev->lock);
+        return ret;
+    }
+
+    pthread_mutex_unlock(&udev->lock);
+    udev_list_entry_init(&tmp.properties);
+    fill(&tmp, syspath, usb);
+    ret = copy_cache(udev_device, &tmp);
+
+    pthread_mutex_lock(&udev->lock);
+    cache = udev_hash_get(&udev->id_cache, syspath);
+
+    if (!cache) {
+        cache = calloc(1, sizeof(*cache));
+
+        if (cache && udev_hash_set(&udev->id_cache, syspath, cache) == -1) {
+            free(cache);
+            cache = NULL;
+        }
+    }
+
+    if (cache) {
+        udev_list_entry_free_all(&cache->properties);
+        cache->properties = tmp.properties;
+        cache->ino = st.st_ino;
+    }
+    else {
+        udev_list_entry_free_all(&tmp.properties);
+    }
+
+    pthread_mutex_unlock(&udev->lock);
+    return ret;
+}
+
+// usbN or N-P[.P...]
+static int is_usb_device(const char *name, size_t len)
+{
+    size_t i;
+
+    if (len > 3 && strncmp(name, "usb", 3) == 0) {
+        for (i = 3; i < len; i++) {
+            if (!isdigit((unsigned char)name[i])) {
+                return 0;
+            }
+        }
+
+        return 1;
+    }
+
+    for (i = 0; i < len && isdigit((unsigned char)name[i]); i++) {
+    }
+
+    if (i == 0 || i == len || name[i] != '-') {
+        return 0;
+    }
+
+    for (i++; i < len; i++) {
+        if (!isdigit((unsigned char)name[i]) && name[i] != '.') {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// N-P[.P...]:C.I
+static int is_usb_interface(const char *name, size_t len)
+{
+    const char *pos;
+
+    pos = memchr(name, ':', len);
+    return pos && is_usb_device(name, pos - name);
+}
+
+// find the closest usb device and usb interface in the syspath of a device
+static int find_usb(const char *syspath, char *device, char *interface)
+{
+    const char *end, *pos;
+
+    interface[0] = '\0';
+
+    for (end = syspath + strlen(syspath); end > syspath; end = pos) {
+        for (pos = end; pos > syspath && pos[-1] != '/'; pos--) {
+        }
+
+        if (is_usb_device(pos, end - pos)) {
+            snprintf(device, PATH_MAX, "%.*s", (int)(end - syspath), syspath);
+            return 0;
+        }
+
+        if (!interface[0] && is_usb_interface(pos, end - pos)) {
+            snprintf(interface, PATH_MAX, "%.*s", (int)(end - syspath), syspath);
+        }
+
+        if (pos > syspath) {
+            pos--;
+        }
+    }
+
+    return -1;
+}
+
+static void set_usb_interfaces(struct id_cache *cache, const char *syspath)
+{
+    char path[PATH_MAX + 256], id[32], class[8], subclass[8], protocol[8], ifs[256] = ":";
+    const char *name;
+    struct dirent *de;
+    size_t len;
+    DIR *dir;
+
+    dir = opendir(syspath);
+
+    if (!dir) {
+        return;
+    }
+
+    name = strrchr(syspath, '/') + 1;
+    len = strlen(name);
+
+    while ((de = readdir(dir))) {
+        if (strncmp(de->d_name, name, len) != 0 || de->d_name[len] != ':') {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", syspath, de->d_name);
+
+        if (read_attr(path, "bInterfaceClass", class, sizeof(class)) == -1 ||
+            read_attr(path, "bInterfaceSubClass", subclass, sizeof(subclass)) == -1 ||
+            read_attr(path, "bInterfaceProtocol", protocol, sizeof(protocol)) == -1) {
+            continue;
+        }
+
+        snprintf(id, sizeof(id), "%s%s%s:", class, subclass, protocol);
+
+        if (!strstr(ifs, id) && strlen(ifs) + strlen(id) < sizeof(ifs)) {
+            strcat(ifs, id);
+        }
+    }
+
+    closedir(dir);
+
+    if (strlen(ifs) > 1) {
+        udev_list_entry_add(&cache->properties, "ID_USB_INTERFACES", ifs, 0);
+    }
+}
+
+static void set_usb_device(struct id_cache *cache, const char *syspath, int usb)
+{
+    char vendor_id[8], model_id[8], revision[8], vendor[256], model[256], serial[256];
+    char buf[256], buf2[1024];
+
+    if (read_attr(syspath, "idVendor", vendor_id, sizeof(vendor_id)) == -1 ||
+        read_attr(syspath, "idProduct", model_id, sizeof(model_id)) == -1) {
+        return;
+    }
+
+    udev_list_entry_add(&cache->properties, "ID_BUS", "usb", 0);
+    udev_list_entry_add(&cache->properties, "ID_VENDOR_ID", vendor_id, 0);
+    udev_list_entry_add(&cache->properties, "ID_MODEL_ID", model_id, 0);
+
+    if (read_attr(syspath, "bcdDevice", revision, sizeof(revision)) == 0) {
+        udev_list_entry_add(&cache->properties, "ID_REVISION", revision, 0);
+    }
+
+    if (read_attr(syspath, "manufacturer", buf, sizeof(buf)) == 0) {
+        encode(buf2, buf, sizeof(buf2));
+        udev_list_entry_add(&cache->properties, "ID_VENDOR_ENC", buf2, 0);
+        sanitize(vendor, buf, sizeof(vendor));
+    }
+    else {
+        snprintf(vendor, sizeof(vendor), "%s", vendor_id);
+    }
+
+    if (read_attr(syspath, "product", buf, sizeof(buf)) == 0) {
+        encode(buf2, buf, sizeof(buf2));
+        udev_list_entry_add(&cache->properties, "ID_MODEL_ENC", buf2, 0);
+        sanitize(model, buf, sizeof(model));
+    }
+    else {
+        snprintf(model, sizeof(model), "%s", model_id);
+    }
+
+    udev_list_entry_add(&cache->properties, "ID_VENDOR", vendor, 0);
+    udev_list_entry_add(&cache->properties, "ID_MODEL", model, 0);
+
+    if (read_attr(syspath, "serial", buf, sizeof(buf)) == 0) {
+        sanitize(serial, buf, sizeof(serial));
+        udev_list_entry_add(&cache->properties, "ID_SERIAL_SHORT", serial, 0);
+        snprintf(buf2, sizeof(buf2), "%s_%s_%s", vendor, model, serial);
+    }
+    else {
+        snprintf(buf2, sizeof(buf2), "%s_%s", vendor, model);
+    }
+
+    udev_list_entry_add(&cache->properties, "ID_SERIAL", buf2, 0);
+    set_usb_interfaces(cache, syspath);
+}
+
+static const char *usb_type(const char *class)
+{
+    static const struct {
+        const char *class;
+        const char *type;
+    } types[] = {
+        { "01", "audio" },
+        { "03", "hid" },
+        { "05", "physical" },
+        { "06", "media" },
+        { "07", "printer" },
+        { "08", "storage" },
+        { "09", "hub" },
+        { "0e", "video" },
+        { "e0", "wireless" },
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (strcmp(class, types[i].class) == 0) {
+            return types[i].type;
+        }
+    }
+
+    return "generic";
+}
+
+static void set_usb_interface(struct udev_device *udev_device, const char *syspath)
+{
+    char buf[PATH_MAX + sizeof("/driver")], link[PATH_MAX];
+    ssize_t len;
+
+    if (read_attr(syspath, "bInterfaceNumber", buf, sizeof(buf)) == 0) {
+        udev_device_add_property(udev_device, "ID_USB_INTERFACE_NUM", buf);
+    }
+
+    if (read_attr(syspath, "bInterfaceClass", buf, sizeof(buf)) == 0) {
+        udev_device_add_property(udev_device, "ID_TYPE", usb_type(buf));
+    }
+
+    snprintf(buf, sizeof(buf), "%s/driver", syspath);
+    len = readlink(buf, link, sizeof(link) - 1);
+
+    if (len != -1) {
+        link[len] = '\0';
+        udev_device_add_property(udev_device, "ID_USB_DRIVER", strrchr(link, '/') + 1);
+    }
+}
+
+static int set_usb(struct udev_device *udev_device, const char *syspath)
+{
+    char device[PATH_MAX], interface[PATH_MAX];
+
+    if (find_usb(syspath, device, interface) == -1) {
+        return -1;
+    }
+
+    if (get_cache(udev_device, device, set_usb_device, 0) == -1) {
+        return -1;
+    }
+
+    if (interface[0]) {
+        set_usb_interface(udev_device, interface);
+    }
+
+    return 0;
+}
+
+void udev_id_usb(struct udev_device *udev_device, void *data)
+{
+    const char *syspath;
+
+    syspath = udev_device_get_syspath(udev_device);
+
+    if (syspath) {
+        set_usb(udev_device, syspath);
+    }
+}
+
+static void set_disk(struct id_cache *cache, const char *syspath, int usb)
+{
+    char device[PATH_MAX + sizeof("/device/subsystem")], link[PATH_MAX], vendor[256], model[256], serial[256], buf[256], buf2[1024];
+    const char *bus = NULL, *subsystem = "";
+    ssize_t len;
+
+    // the subsystem of the parent tells virtio and scsi disks apart,
+    // both of them expose vendor and model
+    snprintf(device, sizeof(device), "%s/device/subsystem", syspath);
+    len = readlink(device, link, sizeof(link) - 1);
+
+    if (len != -1) {
+        link[len] = '\0';
+        subsystem = strrchr(link, '/') + 1;
+    }
+
+    snprintf(device, sizeof(device), "%s/device", syspath);
+
+    // scsi peripheral device type 5 is cd/dvd
+    if (read_attr(device, "type", buf, sizeof(buf)) == 0 && strcmp(buf, "5") == 0) {
+        udev_list_entry_add(&cache->properties, "ID_TYPE", "cd", 0);
+    }
+    else {
+        udev_list_entry_add(&cache->properties, "ID_TYPE", "disk", 0);
+    }
+
+    if (usb) {
+        return;
+    }
+
+    if (strstr(syspath, "/nvme/")) {
+        bus = "nvme";
+    }
+    else if (strstr(syspath, "/ata")) {
+        bus = "ata";
+    }
+    else if (strcmp(subsystem, "scsi") == 0 && read_attr(device, "vendor", buf, sizeof(buf)) == 0) {
+        bus = "scsi";
+        sanitize(vendor, buf, sizeof(vendor));
+        udev_list_entry_add(&cache->properties, "ID_VENDOR", vendor, 0);
+    }
+
+    if (bus) {
+        udev_list_entry_add(&cache->properties, "ID_BUS", bus, 0);
+    }
+
+    model[0] = '\0';
+    serial[0] = '\0';
+
+    if (read_attr(device, "model", buf, sizeof(buf)) == 0) {
+        sanitize(model, buf, sizeof(model));
+        udev_list_entry_add(&cache->properties, "ID_MODEL", model, 0);
+    }
+
+    if (read_attr(device, "rev", buf, sizeof(buf)) == 0 ||
+        read_attr(device, "firmware_rev", buf, sizeof(buf)) == 0) {
+        sanitize(buf2, buf, sizeof(buf2));
+        udev_list_entry_add(&cache->properties, "ID_REVISION", buf2, 0);
+    }
+
+    // nvme and virtio expose the serial number directly
+    if (read_attr(device, "serial", buf, sizeof(buf)) == 0 ||
+        read_attr(syspath, "serial", buf, sizeof(buf)) == 0) {
+        sanitize(serial, buf, sizeof(serial));
+        udev_list_entry_add(&cache->properties, "ID_SERIAL_SHORT", serial, 0);
+    }
+
+    if (read_attr(syspath, "wwid", buf, sizeof(buf)) == 0 ||
+        read_attr(device, "wwid", buf, sizeof(buf)) == 0) {
+        sanitize(buf2, buf, sizeof(buf2));
+        udev_list_entry_add(&cache->properties, "ID_WWN", buf2, 0);
+    }
+
+    if (model[0] && serial[0]) {
+        snprintf(buf2, sizeof(buf2), "%s_%s", model, serial);
+        udev_list_entry_add(&cache->properties, "ID_SERIAL", buf2, 0);
+    }
+    else if (serial[0]) {
+        udev_list_entry_add(&cache->properties, "ID_SERIAL", serial, 0);
+    }
+}
+
+void udev_id_block(struct udev_device *udev_device, void *data)
+{
+    const char *syspath, *devtype, *partition;
+    char disk[PATH_MAX], *pos;
+    int usb;
+
+    syspath = udev_device_get_syspath(udev_device);
+    devtype = udev_device_get_devtype(udev_device);
+
+    if (!syspath) {
+        return;
+    }
+
+    snprintf(disk, sizeof(disk), "%s", syspath);
+
+    // partitions share properties of their disk
+    if (devtype && strcmp(devtype, "partition") == 0) {
+        pos = strrchr(disk, '/');
+
+        if (pos) {
+            *pos = '\0';
+        }
+
+        partition = udev_device_get_sysattr_value(udev_device, "partition");
+
+        if (partition) {
+            udev_device_add_property(udev_device, "ID_PART_ENTRY_NUMBER", partition);
+        }
+    }
+
+    // storage behind usb takes usb identification, the same way usb_id does
+    usb = set_usb(udev_device, disk) == 0;
+    get_cache(udev_device, disk, set_disk, usb);
+}
@@ -15,14 +15,20 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <linux/netlink.h>
 
 #include "udev.h"
 #include "udev_list.h"
+#include "udev_hash.h"
+#include "udev_private.h"
 
 #ifndef UDEV_MONITOR_NLGRP
 #define UDEV_MONITOR_NLGRP 0x4
@@ -31,7 +37,10 @@
 struct udev_monitor {
     struct udev_list_entry subsystem_match;
     struct udev_list_entry devtype_match;
+    struct udev_list_entry tag_match;
     struct udev *udev;
+    uint64_t tag_mask;
+    int tag_fallback;
     unsigned nlgrp;
     int refcount;
     int fd;
@@ -91,6 +100,82 @@ static int filter_subsystem(struct udev_monitor *udev_monitor, struct udev_devic
     return 0;
 }
 
+// forget memoized state of removed devices, even if the event is filtered out
+static void forget_removed(struct udev_monitor *udev_monitor, const char *buf, size_t len)
+{
+    const char *end = buf + len, *devpath = NULL;
+    char syspath[PATH_MAX];
+    int remove = 0;
+
+    for (; buf < end; buf += strnlen(buf, end - buf) + 1) {
+        if (strcmp(buf, "ACTION=remove") == 0) {
+            remove = 1;
+        }
+        else if (strncmp(buf, "DEVPATH=", 8) == 0) {
+            devpath = buf + 8;
+        }
+    }
+
+    if (!remove || !devpath) {
+        return;
+    }
+
+    snprintf(syspath, sizeof(syspath), "/sys%s", devpath);
+    udev_id_remove(udev_monitor->udev, syspath);
+    udev_path_remove(udev_monitor->udev, syspath);
+}
+
+// subsystem is checked on the raw uevent, so that unwanted events don't pay
+// for building a device and running providers
+static int filter_uevent(struct udev_monitor *udev_monitor, const char *buf, size_t len)
+{
+    struct udev_list_entry *list_entry;
+    const char *end = buf + len;
+
+    list_entry = udev_list_entry_get_next(&udev_monitor->subsystem_match);
+
+    if (!list_entry) {
+        return 1;
+    }
+
+    for (; buf < end; buf += strnlen(buf, end - buf) + 1) {
+        if (strncmp(buf, "SUBSYSTEM=", 10) == 0) {
+            return udev_list_entry_get_by_name(list_entry, buf + 10) != NULL;
+        }
+    }
+
+    return 0;
+}
+
+static int filter_tag(struct udev_monitor *udev_monitor, struct udev_device *udev_device)
+{
+    struct udev_list_entry *list_entry;
+
+    list_entry = udev_list_entry_get_next(&udev_monitor->tag_match);
+
+    if (!list_entry) {
+        return 1;
+    }
+
+    if (udev_device_get_tag_mask(udev_device) & udev_monitor->tag_mask) {
+        return 1;
+    }
+
+    if (!udev_monitor->tag_fallback) {
+        return 0;
+    }
+
+    while (list_entry) {
+        if (udev_device_has_tag(udev_device, udev_list_entry_get_name(list_entry))) {
+            return 1;
+        }
+
+        list_entry = udev_list_entry_get_next(list_entry);
+    }
+
+    return 0;
+}
+
 struct udev_device *udev_monitor_receive_device(struct udev_monitor *udev_monitor)
 {
     struct udev_device *udev_device;
@@ -123,6 +208,12 @@ struct udev_device *udev_monitor_receive_device(struct udev_monitor *udev_monito
             continue;
         }
 
+        forget_removed(udev_monitor, buf, len);
+
+        if (!filter_uevent(udev_monitor, buf, len)) {
+            continue;
+        }
+
         udev_device = udev_device_new_from_uevent(udev_monitor->udev, buf, len);
 
         if (!udev_device) {
@@ -130,7 +221,8 @@ struct udev_device *udev_monitor_receive_device(struct udev_monitor *udev_monito
         }
 
         if (!filter_subsystem(udev_monitor, udev_device) ||
-            !filter_devtype(udev_monitor, udev_device)) {
+            !filter_devtype(udev_monitor, udev_device) ||
+            !filter_tag(udev_monitor, udev_device)) {
             udev_device_unref(udev_device);
             continue;
         }
@@ -174,8 +266,20 @@ struct udev *udev_monitor_get_udev(struct udev_monitor *udev_monitor)
     return 0;
 }
 
-/* XXX NOT IMPLEMENTED */ int udev_monitor_filter_remove(struct udev_monitor *udev_monitor)
+int udev_monitor_filter_remove(struct udev_monitor *udev_monitor)
 {
+    if (!udev_monitor) {
+        return -1;
+    }
+
+    udev_list_entry_free_all(&udev_monitor->subsystem_match);
+    udev_list_entry_free_all(&udev_monitor->devtype_match);
+    udev_list_entry_free_all(&udev_monitor->tag_match);
+    udev_list_entry_init(&udev_monitor->subsystem_match);
+    udev_list_entry_init(&udev_monitor->devtype_match);
+    udev_list_entry_init(&udev_monitor->tag_match);
+    udev_monitor->tag_mask = 0;
+    udev_monitor->tag_fallback = 0;
     return 0;
 }
 
@@ -194,8 +298,27 @@ int udev_monitor_filter_add_match_subsystem_devtype(struct udev_monitor *udev_mo
     return 0;
 }
 
-/* XXX NOT IMPLEMENTED */ int udev_monitor_filter_add_match_tag(struct udev_monitor *udev_monitor, const char *tag)
+int udev_monitor_filter_add_match_tag(struct udev_monitor *udev_monitor, const char *tag)
 {
+    int index;
+
+    if (!udev_monitor || !tag) {
+        return -1;
+    }
+
+    if (!udev_list_entry_add(&udev_monitor->tag_match, tag, NULL, 0)) {
+        return -1;
+    }
+
+    index = udev_tag_index(udev_monitor->udev, tag, 1);
+
+    if (index == -1) {
+        udev_monitor->tag_fallback = 1;
+    }
+    else {
+        udev_monitor->tag_mask |= (uint64_t)1 << index;
+    }
+
     return 0;
 }
 
@@ -242,7 +365,7 @@ struct udev_monitor *udev_monitor_ref(struct udev_monitor *udev_monitor)
         return NULL;
     }
 
-    udev_monitor->refcount++;
+    __atomic_add_fetch(&udev_monitor->refcount, 1, __ATOMIC_RELAXED);
     return udev_monitor;
 }
 
@@ -252,12 +375,13 @@ struct udev_monitor *udev_monitor_unref(struct udev_monitor *udev_monitor)
         return NULL;
     }
 
-    if (--udev_monitor->refcount > 0) {
+    if (__atomic_sub_fetch(&udev_monitor->refcount, 1, __ATOMIC_ACQ_REL) > 0) {
         return NULL;
     }
 
     udev_list_entry_free_all(&udev_monitor->devtype_match);
     udev_list_entry_free_all(&udev_monitor->subsystem_match);
+    udev_list_entry_free_all(&udev_monitor->tag_match);
 
     close(udev_monitor->fd);
     free(udev_monitor);
@@ -0,0 +1,521 @@
+/*
+ * Copyright (c) 2020-2021 illiliti <illiliti@protonmail.com>
+ * SPDX-License-Identifier: ISC
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "udev.h"
+#include "udev_list.h"
+#include "udev_hash.h"
+#include "udev_private.h"
+
+// persistent device path, the subset of systemd's path_id builtin which
+// covers pci, usb, scsi, ata, nvme, platform, acpi, serio and virtio.
+// https://github.com/systemd/systemd/blob/v251/src/udev/udev-builtin-path_id.c
+//
+// the path of a device is the path of its closest supported ancestor plus
+// a component of its own. results are memoized per syspath on struct udev,
+// so devices sharing a controller walk up only until the first ancestor
+// which was already resolved. an entry is only trusted while the inode of
+// the syspath is the same, a device which was removed and added again gets
+// a new one.
+
+enum {
+    PATH_PARENT = 1 << 0,
+    PATH_TRANSPORT = 1 << 1,
+    PATH_NVME = 1 << 2,
+};
+
+struct path_cache {
+    char *path;
+    ino_t ino;
+    int flags;
+};
+
+static void free_cache(void *ptr)
+{
+    struct path_cache *cache = ptr;
+
+    if (!cache) {
+        return;
+    }
+
+    free(cache->path);
+    free(cache);
+}
+
+static struct path_cache *copy_cache(const struct path_cache *cache)
+{
+    struct path_cache *copy;
+
+    copy = calloc(1, sizeof(*copy));
+
+    if (!copy) {
+        return NULL;
+    }
+
+    copy->ino = cache->ino;
+    copy->flags = cache->flags;
+
+    if (cache->path) {
+        copy->path = strdup(cache->path);
+
+        if (!copy->path) {
+            free(copy);
+            return NULL;
+        }
+    }
+
+    return copy;
+}
+
+void udev_path_free(struct udev *udev)
+{
+    udev_hash_free(&udev->path_cache, free_cache);
+    udev_hash_free(&udev->scsi_hosts, NULL);
+}
+
+void udev_path_remove(struct udev *udev, const char *syspath)
+{
+    char path[PATH_MAX];
+    char *pos;
+
+    snprintf(path, sizeof(path), "%s", syspath);
+    pos = strrchr(path, '/');
+
+    pthread_mutex_lock(&udev->lock);
+    free_cache(udev_hash_remove(&udev->path_cache, syspath));
+
+    // a host which goes away may have been the base of its controller
+    if (pos && strncmp(pos + 1, "host", 4) == 0 && isdigit((unsigned char)pos[5])) {
+        *pos = '\0';
+        udev_hash_remove(&udev->scsi_hosts, path);
+    }
+
+    pthread_mutex_unlock(&udev->lock);
+}
+
+static int read_subsystem(const char *syspath, char *buf, size_t len)
+{
+    char path[PATH_MAX + sizeof("/subsystem")], link[PATH_MAX];
+    ssize_t cnt;
+
+    snprintf(path, sizeof(path), "%s/subsystem", syspath);
+    cnt = readlink(path, link, sizeof(link) - 1);
+
+    if (cnt == -1) {
+        return -1;
+    }
+
+    link[cnt] = '\0';
+    snprintf(buf, len, "%s", strrchr(link, '/') + 1);
+    return 0;
+}
+
+static int read_attr(const char *syspath, const char *name, char *buf, size_t len)
+{
+    char path[PATH_MAX];
+    size_t cnt;
+    FILE *file;
+
+    snprintf(path, sizeof(path), "%s/%s", syspath, name);
+    file = fopen(path, "r");
+
+    if (!file) {
+        return -1;
+    }
+
+    cnt = fread(buf, 1, len - 1, file);
+    fclose(file);
+    buf[cnt] = '\0';
+
+    while (cnt > 0 && buf[cnt - 1] == '\n') {
+        buf[--cnt] = '\0';
+    }
+
+    return cnt > 0 ? 0 : -1;
+}
+
+// strip the last component, stopping at /sys/devices
+static int dirname_devices(char *path)
+{
+    char *pos;
+
+    pos = strrchr(path, '/');
+
+    if (!pos || pos - path <= (int)sizeof("/sys/devices") - 1) {
+        return -1;
+    }
+
+    *pos = '\0';
+    return 0;
+}
+
+// find the component of path that starts with prefix and a number
+static const char *find_component(const char *path, const char *prefix, char *buf, size_t len)
+{
+    const char *pos, *end;
+    size_t plen = strlen(prefix);
+
+    for (pos = path; (pos = strchr(pos, '/')); pos++) {
+        if (strncmp(pos + 1, prefix, plen) != 0 || !isdigit((unsigned char)pos[plen + 1])) {
+            continue;
+        }
+
+        end = strchr(pos + 1, '/');
+        end = end ? end : pos + strlen(pos);
+        snprintf(buf, len, "%.*s", (int)(end - pos - 1), pos + 1);
+        return buf;
+    }
+
+    return NULL;
+}
+
+// hosts are numbered relative to the first host of the same controller to
+// keep the path stable when other controllers come and go. the base is
+// cached per controller as base + 1 and trusted while that host exists, so
+// disks behind one controller list its directory once.
+static int scsi_host_base(struct udev *udev, const char *syspath, const char *host)
+{
+    char path[PATH_MAX], path2[PATH_MAX + 32];
+    struct dirent *de;
+    uintptr_t cached;
+    int base, num;
+    DIR *dir;
+    char *pos;
+
+    base = atoi(host + 4);
+    snprintf(path, sizeof(path), "%s", syspath);
+    pos = strstr(path, host);
+
+    if (!pos) {
+        return base;
+    }
+
+    pos[-1] = '\0';
+
+    pthread_mutex_lock(&udev->lock);
+    cached = (uintptr_t)udev_hash_get(&udev->scsi_hosts, path);
+    pthread_mutex_unlock(&udev->lock);
+
+    if (cached) {
+        snprintf(path2, sizeof(path2), "%s/host%d", path, (int)cached - 1);
+
+        if (access(path2, F_OK) == 0) {
+            return (int)cached - 1;
+        }
+    }
+
+    dir = opendir(path);
+
+    if (!dir) {
+        return base;
+    }
+
+    while ((de = readdir(dir))) {
+        if (strncmp(de->d_name, "host", 4) != 0 || !isdigit((unsigned char)de->d_name[4])) {
+            continue;
+        }
+
+        num = atoi(de->d_name + 4);
+
+        if (num < base) {
+            base = num;
+        }
+    }
+
+    closedir(dir);
+
+    pthread_mutex_lock(&udev->lock);
+    udev_hash_set(&udev->scsi_hosts, path, (void *)(uintptr_t)(base + 1));
+    pthread_mutex_unlock(&udev->lock);
+    return base;
+}
+
+static int handle_scsi(struct udev *udev, const char *syspath, const char *name, char *comp, size_t len)
+{
+    unsigned int host, bus, target, lun;
+    char buf[PATH_MAX], port[32];
+
+    // only scsi_device, which is named H:C:T:L, contributes to the path
+    if (sscanf(name, "%u:%u:%u:%u", &host, &bus, &target, &lun) != 4) {
+        return -1;
+    }
+
+    if (find_component(syspath, "ata", port, sizeof(port))) {
+        snprintf(buf, sizeof(buf), "/sys/class/ata_port/%s", port);
+
+        if (read_attr(buf, "port_no", port, sizeof(port)) == -1) {
+            return -1;
+        }
+
+        // devices behind a port multiplier have a non-zero bus, otherwise
+        // master and slave are told apart by target, the same as path_id
+        if (bus != 0) {
+            snprintf(comp, len, "ata-%s.%u.0", port, bus);
+        }
+        else {
+            snprintf(comp, len, "ata-%s.%u", port, target);
+        }
+
+        return 0;
+    }
+
+    if (!find_component(syspath, "host", buf, sizeof(buf))) {
+        return -1;
+    }
+
+    snprintf(comp, len, "scsi-%u:%u:%u:%u", host - scsi_host_base(udev, syspath, buf), bus, target, lun);
+    return 0;
+}
+
+static struct path_cache *join(const struct path_cache *parent, const char *comp, int flags)
+{
+    struct path_cache *cache;
+
+    cache = calloc(1, sizeof(*cache));
+
+    if (!cache) {
+        return NULL;
+    }
+
+    cache->flags = flags | (parent->flags & ~PATH_NVME);
+
+    if (comp[0] && parent->path) {
+        cache->path = malloc(strlen(parent->path) + strlen(comp) + 2);
+
+        if (cache->path) {
+            sprintf(cache->path, "%s-%s", parent->path, comp);
+        }
+    }
+    else if (comp[0] || parent->path) {
+        cache->path = strdup(comp[0] ? comp : parent->path);
+    }
+
+    if ((comp[0] || parent->path) && !cache->path) {
+        free(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+static struct path_cache *get_path(struct udev *udev, const char *syspath);
+
+static struct path_cache *resolve(struct udev *udev, const char *syspath)
+{
+    char subsystem[256], comp[PATH_MAX], up[PATH_MAX], buf[256];
+    const char *skip = NULL, *name, *pos;
+    struct path_cache root = {0}, *parent = &root, *cache;
+    int flags = 0;
+
+    comp[0] = '\0';
+    name = strrchr(syspath, '/') + 1;
+
+    if (read_subsystem(syspath, subsystem, sizeof(subsystem)) == -1) {
+        subsystem[0] = '\0';
+    }
+
+    if (strcmp(subsystem, "pci") == 0) {
+        snprintf(comp, sizeof(comp), "pci-%s", name);
+        skip = "pci";
+        flags |= PATH_PARENT;
+    }
+    else if (strcmp(subsystem, "usb") == 0) {
+        // root hubs have no port
+        if ((pos = strchr(name, '-'))) {
+            snprintf(comp, sizeof(comp), "usb-0:%s", pos + 1);
+        }
+
+        skip = "usb";
+        flags |= PATH_PARENT | PATH_TRANSPORT;
+    }
+    else if (strcmp(subsystem, "scsi") == 0) {
+        handle_scsi(udev, syspath, name, comp, sizeof(comp));
+        flags |= PATH_TRANSPORT;
+    }
+    else if (strcmp(subsystem, "platform") == 0) {
+        snprintf(comp, sizeof(comp), "platform-%s", name);
+        skip = "platform";
+        flags |= PATH_PARENT | PATH_TRANSPORT;
+    }
+    else if (strcmp(subsystem, "acpi") == 0) {
+        snprintf(comp, sizeof(comp), "acpi-%s", name);
+        skip = "acpi";
+        flags |= PATH_PARENT;
+    }
+    else if (strcmp(subsystem, "serio") == 0) {
+        for (pos = name; *pos && !isdigit((unsigned char)*pos); pos++) {
+        }
+
+        snprintf(comp, sizeof(comp), "serio-%s", pos);
+        skip = "serio";
+    }
+    else if (strcmp(subsystem, "virtio") == 0) {
+        skip = "virtio";
+        flags |= PATH_TRANSPORT;
+    }
+    else if (strcmp(subsystem, "nvme") == 0) {
+        skip = "nvme";
+        flags |= PATH_NVME;
+    }
+
+    snprintf(up, sizeof(up), "%s", syspath);
+
+    if (dirname_devices(up) == 0) {
+        // ancestors of the same subsystem are covered by this component
+        while (skip && read_subsystem(up, buf, sizeof(buf)) == 0 && strcmp(buf, skip) == 0) {
+            if (dirname_devices(up) == -1) {
+                break;
+            }
+        }
+
+        parent = get_path(udev, up);
+
+        if (!parent) {
+            return NULL;
+        }
+    }
+
+    // namespaces are identified by nsid below the controller
+    if (!comp[0] && (parent->flags & PATH_NVME) && read_attr(syspath, "nsid", buf, sizeof(buf)) == 0) {
+        snprintf(comp, sizeof(comp), "nvme-%s", buf);
+        flags |= PATH_PARENT | PATH_TRANSPORT;
+    }
+
+    cache = join(parent, comp, flags);
+
+    if (parent != &root) {
+        free_cache(parent);
+    }
+
+    return cache;
+}
+
+// returns a copy owned by the caller, entries may be replaced concurrently
+static struct path_cache *get_path(struct udev *udev, const char *syspath)
+{
+    struct path_cache *cache, *copy = NULL;
+    struct stat st;
+
+    // the device is gone, so is its entry
+    if (stat(syspath, &st) == -1) {
+        udev_path_remove(udev, syspath);
+        return resolve(udev, syspath);
+    }
+
+    pthread_mutex_lock(&udev->lock);
+    cache = udev_hash_get(&udev->path_cache, syspath);
+
+    if (cache && cache->ino == st.st_ino) {
+        copy = copy_cache(cache);
+    }
+
+    pthread_mutex_unlock(&udev->lock);
+
+    if (copy) {
+        return copy;
+    }
+
+    // resolve without the lock held, the last one stored wins
+    cache = resolve(udev, syspath);
+
+    if (!cache) {
+        return NULL;
+    }
+
+    cache->ino = st.st_ino;
+    copy = copy_cache(cache);
+
+    if (!copy) {
+        return cache;
+    }
+
+    pthread_mutex_lock(&udev->lock);
+    free_cache(udev_hash_remove(&udev->path_cache, syspath));
+
+    if (udev_hash_set(&udev->path_cache, syspath, copy) == -1) {
+        free_cache(copy);
+    }
+
+    pthread_mutex_unlock(&udev->lock);
+    return cache;
+}
+
+void udev_path_id(struct udev_device *udev_device, void *data)
+{
+    const char *syspath, *subsystem, *devtype, *pos;
+    struct path_cache *cache;
+    char disk[PATH_MAX], tag[PATH_MAX];
+    size_t i = 0;
+
+    syspath = udev_device_get_syspath(udev_device);
+    subsystem = udev_device_get_subsystem(udev_device);
+    devtype = udev_device_get_devtype(udev_device);
+
+    if (!syspath || strncmp(syspath, "/sys/devices/", 13) != 0) {
+        return;
+    }
+
+    snprintf(disk, sizeof(disk), "%s", syspath);
+
+    // partitions inherit the path of their disk
+    if (devtype && strcmp(devtype, "partition") == 0 && dirname_devices(disk) == -1) {
+        return;
+    }
+
+    cache = get_path(udev_device_get_udev(udev_device), disk);
+
+    if (!cache) {
+        return;
+    }
+
+    // block devices without a well-known transport have no stable path
+    if (!cache->path || !(cache->flags & PATH_PARENT) ||
+        (subsystem && strcmp(subsystem, "block") == 0 && !(cache->flags & PATH_TRANSPORT))) {
+        free_cache(cache);
+        return;
+    }
+
+    udev_device_add_property(udev_device, "ID_PATH", cache->path);
+
+    // compose a valid tag name: runs of other characters become single '_'
+    for (pos = cache->path; *pos; pos++) {
+        if (isalnum((unsigned char)*pos) || *pos == '-') {
+            tag[i++] = *pos;
+        }
+        else if (i > 0 && tag[i - 1] != '_') {
+            tag[i++] = '_';
+        }
+    }
+
+    while (i > 0 && tag[i - 1] == '_') {
+        i--;
+    }
+
+    tag[i] = '\0';
+    udev_device_add_property(udev_device, "ID_PATH_TAG", tag);
+    free_cache(cache);
+}
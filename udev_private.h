@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2020-2021 illiliti <illiliti@protonmail.com>
+ * SPDX-License-Identifier: ISC
+ * 
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// tags are interned into bit positions of a 64-bit mask. devices keep their
+// tags as a mask, which turns tag matching into a single AND. tags which do
+// not fit into the registry are only kept in the list of the device.
+#define UDEV_TAG_MAX 64
+
+struct udev_provider {
+    void (*fn)(struct udev_device *udev_device, void *data);
+    struct udev_provider *next;
+    void *data;
+    int builtin;
+};
+
+struct udev_db {
+    const unsigned char *map;
+    size_t size;
+    dev_t dev;
+    ino_t ino;
+    int lock;
+    int absent;
+    int pinned;
+};
+
+struct udev {
+    struct udev_provider *providers_any;
+    struct udev_hash providers;
+    struct udev_hash id_cache;
+    struct udev_hash path_cache;
+    struct udev_hash scsi_hosts;
+    struct udev_hash devlinks;
+    struct udev_list_entry *devlinks_dirs;
+    struct udev_hash tags;
+    struct udev_list_entry *subsystems;
+    nlink_t subsystems_nlink[2];
+    struct udev_db db;
+    pthread_mutex_t lock;
+    int devlinks_fd;
+    int refcount;
+};
+
+int udev_add_provider(struct udev *udev, const char *subsystem,
+        void (*fn)(struct udev_device *udev_device, void *data), void *data, int builtin);
+void udev_run_providers(struct udev *udev, struct udev_device *udev_device, int builtin);
+int udev_add_builtin_providers(struct udev *udev);
+
+struct udev_device *udev_device_new_from_resolved(struct udev *udev, const char *syspath);
+
+int udev_tag_index(struct udev *udev, const char *tag, int add);
+uint64_t udev_device_get_tag_mask(struct udev_device *udev_device);
+
+void udev_id_usb(struct udev_device *udev_device, void *data);
+void udev_id_block(struct udev_device *udev_device, void *data);
+void udev_id_free(struct udev *udev);
+void udev_id_remove(struct udev *udev, const char *syspath);
+
+void udev_path_id(struct udev_device *udev_device, void *data);
+void udev_path_free(struct udev *udev);
+void udev_path_remove(struct udev *udev, const char *syspath);
+
+int udev_devlinks_get(struct udev *udev, const char *id, struct udev_list_entry *devlinks);
+void udev_devlinks_free(struct udev *udev);
+
+int udev_subsystems_get(struct udev *udev, struct udev_list_entry *subsystems);
+void udev_subsystems_free(struct udev *udev);
+
+int udev_db_begin(struct udev *udev);
+void udev_db_end(struct udev *udev);
+const char *udev_db_next(struct udev *udev, uint32_t *pos);
+int udev_db_get(struct udev *udev, const char *syspath, struct udev_list_entry *properties);
+void udev_db_free(struct udev *udev);